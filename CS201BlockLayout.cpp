@@ -0,0 +1,319 @@
+// Profile-guided block layout and hot/cold splitting.
+//
+//   opt -load CS201Profiling.so -cs201-layout -cs201-profile-use=prog.profile prog.bc
+//
+// prog.profile is the output of the program instrumented by -pathProfiling
+// from the same prog.bc (see ProfileData.h). For every function that ran:
+//   - the edge counts become !prof branch weights,
+//   - the blocks are reordered by ExtTSP-style chain merging,
+//   - single-entry regions that never ran are extracted into <name>.cold.N
+//     functions, cold and (on ELF targets) in .text.unlikely.
+// Functions that never ran are marked cold and, on ELF, moved to
+// .text.unlikely as a whole.
+#include "ProfileData.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+
+using namespace llvm;
+using namespace cs201;
+
+static cl::opt<bool> SplitCold("cs201-split-cold", cl::init(true),
+    cl::desc("Extract blocks that never ran into .cold functions"));
+
+static cl::opt<unsigned> ColdSplitThreshold("cs201-cold-split-threshold", cl::init(8),
+    cl::desc("Minimum number of instructions in an extracted cold region"));
+
+namespace {
+    // ExtTSP parameters (Newell & Pupyrev): a fall-through is worth the full
+    // edge weight, short forward/backward jumps a tenth of it.
+    const double ForwardWeight = 0.1;
+    const double BackwardWeight = 0.1;
+    const uint64_t ForwardDistance = 1024;
+    const uint64_t BackwardDistance = 640;
+
+    struct Chain {
+        std::vector<unsigned> blocks;
+        uint64_t weight;
+        uint64_t size;
+    };
+
+    struct CS201BlockLayout : public ModulePass {
+        static char ID;
+        CS201BlockLayout() : ModulePass(ID) {}
+        ProfileData profile;
+        std::vector<BasicBlock*> blocks;
+        std::vector<uint64_t> counts;
+        std::vector<uint64_t> sizes;
+        std::map<std::pair<unsigned, unsigned>, uint64_t> edges;
+
+        //----------------------------------
+        bool runOnModule(Module &M) override {
+            std::string error;
+            if (ProfileUse.empty() || !profile.read(ProfileUse, error)) {
+                errs() << "cs201-layout: no profile (" << (ProfileUse.empty() ? "use -cs201-profile-use" : error) << ")\n";
+                return false;
+            }
+            // extraction adds functions, so walk a snapshot
+            std::vector<Function*> functions;
+            for (auto &F: M) {
+                if (!F.isDeclaration()) {
+                    functions.push_back(&F);
+                }
+            }
+            bool changed = false;
+            for (Function *F: functions) {
+                changed |= runOnFunction(*F);
+            }
+            return changed;
+        }
+
+        bool runOnFunction(Function &F) {
+            ProfileData::Match match;
+            const FunctionProfile *fp = profile.getMatched(F, &match);
+            // without a checksum the block count is the only check we have
+            if (!fp || (match == ProfileData::Unchecked && fp->blocks.size() != F.size())) {
+                return false;
+            }
+            if (fp->entryCount() == 0) {
+                errs() << "Function: " << F.getName() << " never ran, marked cold\n";
+                F.addFnAttr(Attribute::Cold);
+                setUnlikelySection(F);
+                return true;
+            }
+
+            blocks.clear();
+            counts.clear();
+            sizes.clear();
+            edges.clear();
+            for (auto &BB: F) {
+                auto count = fp->blocks.find(blocks.size());
+                counts.push_back(count == fp->blocks.end() ? 0 : count->second);
+                // no code size this early; a few bytes per IR instruction is close enough for the distances
+                sizes.push_back(4 * BB.size());
+                blocks.push_back(&BB);
+            }
+            edges = fp->edges;
+
+            setBranchWeights();
+            std::vector<unsigned> order = layout();
+            for (unsigned i = 1; i < order.size(); ++i) {
+                blocks.at(order.at(i))->moveAfter(blocks.at(order.at(i-1)));
+            }
+            errs() << "Function: " << F.getName() << " layout:";
+            for (unsigned b: order) {
+                errs() << " b" << b;
+            }
+            errs() << '\n';
+
+            // a block the remapping lost reads as never run; don't move it out
+            if (SplitCold && match != ProfileData::Remapped) {
+                splitCold(F);
+            }
+            return true;
+        }
+
+        // .text.unlikely only means something to ELF linkers
+        static void setUnlikelySection(Function &F) {
+            if (Triple(F.getParent()->getTargetTriple()).isOSBinFormatELF()) {
+                F.setSection(".text.unlikely");
+            }
+        }
+
+        unsigned indexOf(BasicBlock *BB) {
+            return std::find(blocks.begin(), blocks.end(), BB) - blocks.begin();
+        }
+
+        void setBranchWeights() {
+            for (unsigned b = 0; b < blocks.size(); ++b) {
+                TerminatorInst *term = blocks.at(b)->getTerminator();
+                if (term->getNumSuccessors() < 2 || !(isa<BranchInst>(term) || isa<SwitchInst>(term))) {
+                    continue;
+                }
+                std::vector<uint32_t> weights;
+                for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+                    auto it = edges.find(std::make_pair(b, indexOf(term->getSuccessor(i))));
+                    uint64_t w = it == edges.end() ? 0 : it->second;
+                    // +1 keeps never-taken edges possible rather than impossible
+                    weights.push_back((uint32_t)std::min<uint64_t>(w, UINT32_MAX - 1) + 1);
+                }
+                MDBuilder MDB(term->getContext());
+                term->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(weights));
+            }
+        }
+
+        double score(const std::vector<unsigned> &order) {
+            std::map<unsigned, uint64_t> addr;
+            uint64_t pos = 0;
+            for (unsigned b: order) {
+                addr[b] = pos;
+                pos += sizes.at(b);
+            }
+            double total = 0;
+            for (auto it = edges.begin(); it != edges.end(); ++it) {
+                auto src = addr.find(it->first.first);
+                auto dst = addr.find(it->first.second);
+                if (src == addr.end() || dst == addr.end() || it->second == 0) {
+                    continue;
+                }
+                uint64_t srcEnd = src->second + sizes.at(it->first.first);
+                double w = it->second;
+                if (dst->second == srcEnd) {
+                    total += w;
+                }
+                else if (dst->second > srcEnd && dst->second - srcEnd <= ForwardDistance) {
+                    total += ForwardWeight * w * (1.0 - double(dst->second - srcEnd) / ForwardDistance);
+                }
+                else if (dst->second < srcEnd && srcEnd - dst->second <= BackwardDistance) {
+                    total += BackwardWeight * w * (1.0 - double(srcEnd - dst->second) / BackwardDistance);
+                }
+            }
+            return total;
+        }
+
+        // Greedily concatenate the pair of chains with the largest ExtTSP gain
+        // (the entry chain always stays in front), then order the chains by
+        // execution density with the cold ones last.
+        std::vector<unsigned> layout() {
+            std::vector<Chain> chains;
+            std::vector<unsigned> chainOf;
+            for (unsigned b = 0; b < blocks.size(); ++b) {
+                chains.push_back({{b}, counts.at(b), std::max<uint64_t>(sizes.at(b), 1)});
+                chainOf.push_back(b);
+            }
+            std::vector<double> scores(chains.size(), 0);
+
+            while (true) {
+                double bestGain = 0;
+                unsigned bestX = 0, bestY = 0;
+                std::map<std::pair<unsigned, unsigned>, bool> tried;
+                for (auto it = edges.begin(); it != edges.end(); ++it) {
+                    if (it->second == 0 || it->first.first >= blocks.size() || it->first.second >= blocks.size()) {
+                        continue;
+                    }
+                    unsigned cs = chainOf.at(it->first.first);
+                    unsigned cd = chainOf.at(it->first.second);
+                    if (cs == cd) {
+                        continue;
+                    }
+                    for (auto xy: {std::make_pair(cs, cd), std::make_pair(cd, cs)}) {
+                        // nothing may be placed before the entry block
+                        if (xy.second == chainOf.at(0) || tried[xy]) {
+                            continue;
+                        }
+                        tried[xy] = true;
+                        std::vector<unsigned> merged = chains.at(xy.first).blocks;
+                        merged.insert(merged.end(), chains.at(xy.second).blocks.begin(), chains.at(xy.second).blocks.end());
+                        double gain = score(merged) - scores.at(xy.first) - scores.at(xy.second);
+                        if (gain > bestGain) {
+                            bestGain = gain;
+                            bestX = xy.first;
+                            bestY = xy.second;
+                        }
+                    }
+                }
+                if (bestGain <= 0) {
+                    break;
+                }
+                Chain &X = chains.at(bestX);
+                Chain &Y = chains.at(bestY);
+                for (unsigned b: Y.blocks) {
+                    chainOf.at(b) = bestX;
+                }
+                X.blocks.insert(X.blocks.end(), Y.blocks.begin(), Y.blocks.end());
+                X.weight += Y.weight;
+                X.size += Y.size;
+                Y.blocks.clear();
+                scores.at(bestX) = score(X.blocks);
+                scores.at(bestY) = 0;
+            }
+
+            std::vector<Chain*> rest;
+            for (auto &chain: chains) {
+                if (!chain.blocks.empty() && &chain != &chains.at(chainOf.at(0))) {
+                    rest.push_back(&chain);
+                }
+            }
+            std::stable_sort(rest.begin(), rest.end(), [](Chain *a, Chain *b) {
+                return double(a->weight) / a->size > double(b->weight) / b->size;
+            });
+            std::vector<unsigned> order = chains.at(chainOf.at(0)).blocks;
+            for (Chain *chain: rest) {
+                order.insert(order.end(), chain->blocks.begin(), chain->blocks.end());
+            }
+            return order;
+        }
+
+        // Each cold block whose immediate dominator ran heads a single-entry
+        // region: itself plus the cold blocks it dominates.
+        void splitCold(Function &F) {
+            DominatorTree DT;
+            DT.recalculate(F);
+            std::vector<BasicBlock*> claimed;
+            unsigned n = 0;
+            for (unsigned b = 1; b < blocks.size(); ++b) {
+                BasicBlock *root = blocks.at(b);
+                DomTreeNode *node = DT.getNode(root);
+                if (counts.at(b) != 0 || !node || !node->getIDom()) {
+                    continue;
+                }
+                // an earlier extraction may have made its call block the idom;
+                // that block has no count, so leave the region alone
+                unsigned idom = indexOf(node->getIDom()->getBlock());
+                if (idom == blocks.size() || counts.at(idom) == 0) {
+                    continue;
+                }
+                if (root->getParent() != &F || std::find(claimed.begin(), claimed.end(), root) != claimed.end() || root->isLandingPad()) {
+                    continue;
+                }
+                // the region header has to come first for CodeExtractor
+                std::vector<BasicBlock*> region = {root};
+                unsigned insts = root->size();
+                for (unsigned c = 0; c < blocks.size(); ++c) {
+                    BasicBlock *BB = blocks.at(c);
+                    // blocks already extracted now belong to another function
+                    if (BB == root || BB->getParent() != &F || !DT.isReachableFromEntry(BB)) {
+                        continue;
+                    }
+                    if (counts.at(c) == 0 && DT.dominates(root, BB)) {
+                        region.push_back(blocks.at(c));
+                        insts += blocks.at(c)->size();
+                    }
+                }
+                if (insts < ColdSplitThreshold) {
+                    continue;
+                }
+                CodeExtractor CE(region, &DT);
+                if (!CE.isEligible()) {
+                    continue;
+                }
+                claimed.insert(claimed.end(), region.begin(), region.end());
+                if (Function *cold = CE.extractCodeRegion()) {
+                    cold->setName(F.getName() + ".cold." + Twine(n++));
+                    cold->addFnAttr(Attribute::Cold);
+                    cold->addFnAttr(Attribute::NoInline);
+                    setUnlikelySection(*cold);
+                    errs() << "Function: " << F.getName() << " split " << region.size() << " cold blocks into " << cold->getName() << '\n';
+                    // extraction rewrote the CFG around the region
+                    DT.recalculate(F);
+                }
+            }
+        }
+    };
+}
+
+char CS201BlockLayout::ID = 0;
+static RegisterPass<CS201BlockLayout> X("cs201-layout", "CS201 profile-guided block layout", false, false);
@@ -0,0 +1,189 @@
+// Hot function ordering for the linker.
+//
+//   opt -load CS201Profiling.so -cs201-function-order -cs201-profile-use=prog.profile \
+//       -cs201-order-file=prog.order prog.bc -disable-output
+//
+// Function hotness is the entry block count (b0) from the profile. The call
+// graph is read from the module itself, each call site weighted by the count
+// of the block it sits in. Functions are clustered with C3 (Ottoni & Maher,
+// "Optimizing Function Placement for Large-Scale Data-Center Applications"):
+// hottest first, each function is appended to the cluster of its hottest
+// caller while the cluster stays within a page, then clusters are sorted by
+// density. The file lists one symbol per line for lld --symbol-ordering-file,
+// or .text.<name> sections (build with -ffunction-sections) for gold
+// --section-ordering-file.
+#include "ProfileData.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+
+using namespace llvm;
+using namespace cs201;
+
+static cl::opt<std::string> OrderFile("cs201-order-file", cl::init("cs201.order"),
+    cl::desc("Where -cs201-function-order writes the ordering"),
+    cl::value_desc("filename"));
+
+enum OrderFormat { OrderSymbols, OrderSections };
+static cl::opt<OrderFormat> OrderFileFormat("cs201-order-format", cl::init(OrderSymbols),
+    cl::desc("Ordering file flavour"),
+    cl::values(clEnumValN(OrderSymbols, "symbol", "symbol names (lld --symbol-ordering-file)"),
+               clEnumValN(OrderSections, "section", ".text.<name> sections (gold --section-ordering-file)"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> ClusterSize("cs201-cluster-size", cl::init(4096),
+    cl::desc("C3 stops growing a cluster past this many bytes"));
+
+namespace {
+    struct Cluster {
+        std::vector<Function*> functions;
+        uint64_t weight;
+        uint64_t size;
+    };
+
+    struct CS201FunctionOrder : public ModulePass {
+        static char ID;
+        CS201FunctionOrder() : ModulePass(ID) {}
+        ProfileData profile;
+        std::map<Function*, uint64_t> entryCounts;
+        std::map<Function*, uint64_t> sizes;
+        // callee -> caller -> weight
+        std::map<Function*, std::map<Function*, uint64_t>> callers;
+
+        //----------------------------------
+        bool runOnModule(Module &M) override {
+            std::string error;
+            if (ProfileUse.empty() || !profile.read(ProfileUse, error)) {
+                errs() << "cs201-function-order: no profile (" << (ProfileUse.empty() ? "use -cs201-profile-use" : error) << ")\n";
+                return false;
+            }
+            for (auto &F: M) {
+                if (!F.isDeclaration()) {
+                    readFunction(F);
+                }
+            }
+
+            std::vector<Cluster> clusters = clusterC3(M);
+            std::error_code ec;
+            raw_fd_ostream out(OrderFile, ec, sys::fs::F_Text);
+            if (ec) {
+                errs() << "cs201-function-order: " << OrderFile << ": " << ec.message() << '\n';
+                return false;
+            }
+            unsigned n = 0;
+            for (auto &cluster: clusters) {
+                for (Function *F: cluster.functions) {
+                    out << (OrderFileFormat == OrderSections ? ".text." : "") << F->getName() << '\n';
+                    ++n;
+                }
+            }
+            errs() << "Function order: " << n << " hot functions in " << clusters.size() << " clusters written to " << OrderFile << '\n';
+            return false;
+        }
+
+        void readFunction(Function &F) {
+            const FunctionProfile *fp = profile.getMatched(F);
+            uint64_t size = 0;
+            for (auto &BB: F) {
+                size += 4 * BB.size();
+            }
+            sizes[&F] = std::max<uint64_t>(size, 1);
+            entryCounts[&F] = fp ? fp->entryCount() : 0;
+            if (!fp) {
+                return;
+            }
+            unsigned bnum = 0;
+            for (auto &BB: F) {
+                auto count = fp->blocks.find(bnum++);
+                if (count == fp->blocks.end() || count->second == 0) {
+                    continue;
+                }
+                for (auto &I: BB) {
+                    // invokes too, or C++ callers lose their edges
+                    CallSite CS(&I);
+                    Function *callee = CS ? CS.getCalledFunction() : NULL;
+                    if (callee && !callee->isDeclaration()) {
+                        callers[callee][&F] += count->second;
+                    }
+                }
+            }
+        }
+
+        // hot functions are taken in module order, not from the pointer-keyed
+        // maps, so ties come out the same on every run
+        std::vector<Cluster> clusterC3(Module &M) {
+            std::vector<Function*> hot;
+            std::map<Function*, unsigned> position;
+            unsigned n = 0;
+            for (auto &F: M) {
+                position[&F] = n++;
+                auto count = entryCounts.find(&F);
+                if (count != entryCounts.end() && count->second) {
+                    hot.push_back(&F);
+                }
+            }
+            std::stable_sort(hot.begin(), hot.end(), [this](Function *a, Function *b) {
+                return entryCounts[a] > entryCounts[b];
+            });
+
+            std::vector<Cluster> clusters;
+            std::map<Function*, unsigned> clusterOf;
+            for (Function *F: hot) {
+                clusterOf[F] = clusters.size();
+                clusters.push_back({{F}, entryCounts[F], sizes[F]});
+            }
+            for (Function *F: hot) {
+                Function *caller = NULL;
+                uint64_t best = 0;
+                for (auto it = callers[F].begin(); it != callers[F].end(); ++it) {
+                    bool earlier = it->second == best && caller && position[it->first] < position[caller];
+                    if ((it->second > best || earlier) && clusterOf.count(it->first)) {
+                        best = it->second;
+                        caller = it->first;
+                    }
+                }
+                if (!caller) {
+                    continue;
+                }
+                unsigned into = clusterOf[caller];
+                unsigned from = clusterOf[F];
+                if (into == from || clusters.at(into).size + clusters.at(from).size > ClusterSize) {
+                    continue;
+                }
+                Cluster &dst = clusters.at(into);
+                Cluster &src = clusters.at(from);
+                for (Function *G: src.functions) {
+                    clusterOf[G] = into;
+                }
+                dst.functions.insert(dst.functions.end(), src.functions.begin(), src.functions.end());
+                dst.weight += src.weight;
+                dst.size += src.size;
+                src.functions.clear();
+            }
+
+            std::vector<Cluster> result;
+            for (auto &cluster: clusters) {
+                if (!cluster.functions.empty()) {
+                    result.push_back(cluster);
+                }
+            }
+            std::stable_sort(result.begin(), result.end(), [](const Cluster &a, const Cluster &b) {
+                return double(a.weight) / a.size > double(b.weight) / b.size;
+            });
+            return result;
+        }
+    };
+}
+
+char CS201FunctionOrder::ID = 0;
+static RegisterPass<CS201FunctionOrder> X("cs201-function-order", "CS201 hot function ordering file", false, false);
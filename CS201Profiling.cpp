@@ -7,14 +7,80 @@
 #include "llvm/IR/Type.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "ProfileData.h"
 #include <vector>
+#include <list>
+#include <set>
 #include <map>
 #include <algorithm>
+#include <iterator>
 #include <utility>
 #include <string>
 
 using namespace llvm;
 
+static cl::opt<bool> ProfileTiming("profile-timing",
+    cl::desc("Read the cycle counter at function and loop entry/exit (needs runtime/)"));
+
+static cl::opt<bool> ProfilePerf("profile-perf",
+    cl::desc("Also accumulate perf_event_open counters (cache and branch misses, or software "
+             "events where there is no PMU) in the -profile-timing regions (needs runtime/)"));
+
+static cl::opt<bool> ProfileDump("profile-dump", cl::init(true),
+    cl::desc("Print the counters with printf when main returns"));
+
+static cl::opt<std::string> ProfileFile("profile-file",
+    cl::desc("Have the runtime write the profile to this file at exit instead of printing it; "
+             "%p, %h and %m expand to pid, host name and module hash (needs runtime/)"),
+    cl::value_desc("pattern"));
+
+static cl::opt<bool> ProfileMerge("profile-merge",
+    cl::desc("Add to the counts already in the -profile-file file, under flock"));
+
+static cl::opt<unsigned> LoopPaths("profile-loop-paths", cl::init(0),
+    cl::desc("Record the sequences of k consecutive iteration paths of every loop, 0 = off (needs runtime/)"),
+    cl::value_desc("k"));
+
+static cl::opt<unsigned> LoopPathTable("profile-loop-path-table", cl::init(1024),
+    cl::desc("Distinct traces kept per loop and thread for -profile-loop-paths"));
+
+static cl::opt<unsigned> LoopPathTop("profile-loop-path-top", cl::init(10),
+    cl::desc("Traces reported per loop for -profile-loop-paths"));
+
+static cl::opt<std::string> AnalysisCache("profile-analysis-cache",
+    cl::desc("Keep dominator sets, back edges, loops, coverage probe choices and counter sharing per CFG shape "
+             "in this directory, and reuse them for functions whose CFG is unchanged"),
+    cl::value_desc("directory"));
+
+static cl::opt<bool> ProfileShareCounters("profile-share-counters", cl::init(false),
+    cl::desc("Give control-equivalent blocks one counter; the dump prints it for each of them "
+             "(approximate: a call that exits, longjmps or throws in between leaves them apart)"));
+
+static cl::opt<bool> ProfileAlloc("profile-alloc",
+    cl::desc("Count calls, bytes, size classes and live bytes per malloc/calloc/realloc/new call site (needs runtime/)"));
+
+static cl::opt<unsigned> AllocTop("profile-alloc-top", cl::init(20),
+    cl::desc("Sites reported for -profile-alloc"));
+
+enum CoverageMode { CoverageOff, CoverageByte, CoverageBit };
+static cl::opt<CoverageMode> ProfileCoverage("profile-coverage",
+    cl::desc("Record only whether each block and edge ran (needs runtime/)"),
+    cl::init(CoverageOff),
+    cl::values(clEnumValN(CoverageByte, "byte", "one byte per block/edge, set with a plain store"),
+               clEnumValN(CoverageBit, "bit", "one bit per block/edge in a packed bitmap"),
+               clEnumValEnd));
+
 namespace {
     // https://github.com/thomaslee/llvm-demo/blob/master/main.cc
     static Function* printf_prototype(LLVMContext& ctx, Module *mod) {
@@ -29,6 +95,15 @@ namespace {
         return func;
     }
 
+    // declare (or reuse) one of the runtime/ entry points
+    static Function* runtime_prototype(Module *mod, StringRef name, FunctionType *type) {
+        Function *func = mod->getFunction(name);
+        if(!func)
+            func = Function::Create(type, Function::ExternalLinkage, name, mod);
+        func->setCallingConv(CallingConv::C);
+        return func;
+    }
+
     struct CS201Profiling : public FunctionPass {
         static char ID;
         LLVMContext *Context;
@@ -43,6 +118,85 @@ namespace {
         std::map<StringRef, std::map<StringRef, GlobalVariable*>> _BBCOUNTERS;
         std::map<StringRef, std::map<StringRef, std::vector<std::vector<BasicBlock*>>>> _LOOPS;
         std::map<StringRef, std::map<StringRef, GlobalVariable*>> _EDGECOUNTERS;
+        // "checksum" and one anchor per original block, taken before any
+        // instrumentation so a later build can tell its CFG apart (ProfileData)
+        std::map<StringRef, std::map<StringRef, GlobalVariable*>> _CFGROWS;
+        // edge block inserted by initEdges for every (from, to) CFG edge; a
+        // switch with several cases on one target has several
+        std::multimap<std::pair<BasicBlock*, BasicBlock*>, BasicBlock*> edgeBlocks;
+        // names of the indirectbr edges, which have no edge block to hold them
+        std::list<std::string> successorEdgeNames;
+        // landing pad left for the other invokes after splitting off an unwind
+        // edge -> the pad they originally unwound to
+        std::map<BasicBlock*, BasicBlock*> restPads;
+        Function *timingEnterFunc = NULL;
+        Function *timingExitFunc = NULL;
+        Function *timingDumpFunc = NULL;
+        unsigned timingRegions = 0;
+        // Coverage mode: bbCounters/edgeCounters point at the function's bitmap
+        // and each name maps to its slot. A pruned block has no probe of its own,
+        // its coverage is the OR of the slots in `implied`.
+        struct CoverageSlot {
+            unsigned index;
+            std::vector<unsigned> implied;
+        };
+        std::vector<std::vector<BasicBlock*>> postDomSet;
+        std::vector<bool> reachesExit;
+        GlobalVariable *covMap = NULL;
+        unsigned covSlots = 0;
+        std::map<StringRef, CoverageSlot> coverageSlots;
+        std::map<StringRef, std::map<StringRef, CoverageSlot>> _COVERAGESLOTS;
+        std::map<StringRef, GlobalVariable*> _COVERAGEMAPS;
+        Function *coverageAddFunc = NULL;
+        Function *coverageDumpFunc = NULL;
+        // -profile-loop-paths: Ball-Larus numbering of one iteration of a
+        // loop, over its body with every inner loop collapsed into its header.
+        // Edges with to == NULL end the iteration (back edge or loop exit).
+        struct PathEdge {
+            BasicBlock *from;
+            BasicBlock *to;
+            std::string label;
+            unsigned value;
+        };
+        struct LoopPathPlan {
+            BasicBlock *header;
+            std::vector<BasicBlock*> nodes;
+            std::vector<BasicBlock*> innerHeaders;
+            std::vector<PathEdge> dag;
+            // CFG edge -> dag index
+            std::map<std::pair<BasicBlock*, BasicBlock*>, unsigned> cfgEdges;
+            uint64_t numPaths;
+        };
+        std::vector<LoopPathPlan> loopPlans;
+        std::vector<Constant*> loopPathDescs;
+        StructType *pathEdgeTy = NULL;
+        StructType *loopDescTy = NULL;
+        Function *loopPathFunc = NULL;
+        Function *loopPathDumpFunc = NULL;
+        // -profile-alloc: one descriptor per instrumented allocation call
+        enum AllocKind { NotAlloc, AllocMalloc, AllocCalloc, AllocRealloc, AllocFree };
+        std::vector<Constant*> allocSiteDescs;
+        StructType *allocSiteTy = NULL;
+        Function *allocFunc = NULL;
+        Function *freeFunc = NULL;
+        Function *allocDumpFunc = NULL;
+        unsigned cacheHits = 0;
+        unsigned cacheMisses = 0;
+        unsigned sharedBlocks = 0;
+        unsigned countedBlocks = 0;
+        // the profile dump: main calls these, doFinalization fills them in
+        struct DumpRow {
+            unsigned kind;
+            int slot;
+            int function;
+            int name;
+            GlobalVariable *counter;
+        };
+        Function *profilePrintFunc = NULL;
+        Function *coverageFixupFunc = NULL;
+        Function *coverageRegisterFunc = NULL;
+        unsigned profileTableRows = 0;
+        std::string profileNames;
         //----------------------------------
         bool doInitialization(Module &M) {
             errs() << "\n---------Starting Path Profiling---------\n";
@@ -53,6 +207,60 @@ namespace {
 
             printf_func = printf_prototype(*Context, &M);
 
+            // the counters are read by the timing probes
+            if (ProfilePerf) {
+                ProfileTiming = true;
+            }
+            if (ProfileTiming) {
+                Type *voidTy = Type::getVoidTy(*Context);
+                Type *i32 = Type::getInt32Ty(*Context);
+                timingEnterFunc = runtime_prototype(&M, "__cs201_timing_enter", FunctionType::get(voidTy, {i32, Type::getInt8PtrTy(*Context)}, false));
+                timingExitFunc = runtime_prototype(&M, "__cs201_timing_exit", FunctionType::get(voidTy, {i32}, false));
+                timingDumpFunc = runtime_prototype(&M, "__cs201_timing_dump", FunctionType::get(voidTy, false));
+            }
+            if (ProfilePerf) {
+                // switch the runtime over before any region is entered
+                FunctionType *ctorTy = FunctionType::get(Type::getVoidTy(*Context), false);
+                Function *ctor = Function::Create(ctorTy, GlobalValue::InternalLinkage, "cs201.perf.ctor", &M);
+                IRBuilder<> IRB(BasicBlock::Create(*Context, "entry", ctor));
+                IRB.CreateCall(runtime_prototype(&M, "__cs201_timing_perf", ctorTy));
+                IRB.CreateRetVoid();
+                appendToGlobalCtors(M, ctor, 0);
+            }
+            if (ProfileCoverage != CoverageOff) {
+                Type *voidTy = Type::getVoidTy(*Context);
+                Type *i8Ptr = Type::getInt8PtrTy(*Context);
+                coverageAddFunc = runtime_prototype(&M, "__cs201_coverage_add", FunctionType::get(voidTy, {i8Ptr, i8Ptr, Type::getInt32Ty(*Context)}, false));
+                coverageDumpFunc = runtime_prototype(&M, "__cs201_coverage_dump", FunctionType::get(voidTy, false));
+                // no !cs201.counters in this mode; tells tools/cs201-run why
+                M.getOrInsertNamedMetadata("cs201.coverage")->addOperand(MDNode::get(*Context, MDString::get(*Context, ProfileCoverage == CoverageBit ? "bit" : "byte")));
+            }
+
+            if (LoopPaths) {
+                Type *voidTy = Type::getVoidTy(*Context);
+                Type *i8Ptr = Type::getInt8PtrTy(*Context);
+                Type *i32 = Type::getInt32Ty(*Context);
+                pathEdgeTy = StructType::create(*Context, {i32, i32, i32, i8Ptr}, "cs201.path.edge");
+                loopDescTy = StructType::create(*Context, {i8Ptr, i8Ptr->getPointerTo(), pathEdgeTy->getPointerTo(), i32, i32}, "cs201.loop.desc");
+                loopPathFunc = runtime_prototype(&M, "__cs201_loop_path", FunctionType::get(voidTy, {i32, i32, i32}, false));
+                loopPathDumpFunc = runtime_prototype(&M, "__cs201_loop_paths_dump", FunctionType::get(voidTy, false));
+            }
+
+            if (ProfileAlloc) {
+                Type *voidTy = Type::getVoidTy(*Context);
+                Type *i8Ptr = Type::getInt8PtrTy(*Context);
+                allocSiteTy = StructType::create(*Context, {i8Ptr, i8Ptr, i8Ptr, i8Ptr}, "cs201.alloc.site");
+                allocFunc = runtime_prototype(&M, "__cs201_alloc", FunctionType::get(voidTy, {Type::getInt32Ty(*Context), i8Ptr, Type::getInt64Ty(*Context)}, false));
+                freeFunc = runtime_prototype(&M, "__cs201_free", FunctionType::get(voidTy, {i8Ptr}, false));
+                allocDumpFunc = runtime_prototype(&M, "__cs201_alloc_dump", FunctionType::get(voidTy, false));
+            }
+
+            if (!AnalysisCache.empty()) {
+                if (std::error_code ec = sys::fs::create_directories(AnalysisCache)) {
+                    errs() << "Analysis cache: " << AnalysisCache << ": " << ec.message() << '\n';
+                }
+            }
+
             errs() << "Module: " << M.getName() << "\n";
 
             return true;
@@ -60,6 +268,36 @@ namespace {
 
         //----------------------------------
         bool doFinalization(Module &M) {
+            if (ProfileCoverage != CoverageOff && !coverageFixupFunc && !ProfileFile.empty()) {
+                coverageFixupFunc = Function::Create(FunctionType::get(Type::getVoidTy(*Context), false), GlobalValue::InternalLinkage, "cs201.coverage.fixup", &M);
+            }
+            if (coverageFixupFunc) {
+                buildCoverageFixup(M);
+            }
+            if (coverageRegisterFunc) {
+                buildCoverageRegister(M);
+            }
+            if (profilePrintFunc || !ProfileFile.empty()) {
+                GlobalVariable *table = buildProfileTable(M);
+                if (profilePrintFunc) {
+                    buildProfilePrint(M, table);
+                }
+                if (!ProfileFile.empty()) {
+                    registerProfileFile(M, table);
+                }
+            }
+            if (LoopPaths && !loopPathDescs.empty()) {
+                registerLoopPaths(M);
+            }
+            if (ProfileAlloc && !allocSiteDescs.empty()) {
+                registerAllocSites(M);
+            }
+            if (sharedBlocks) {
+                errs() << "Shared counters: " << countedBlocks - sharedBlocks << " counters for " << countedBlocks << " blocks\n";
+            }
+            if (!AnalysisCache.empty()) {
+                errs() << "Analysis cache: " << cacheHits << " hits, " << cacheMisses << " misses (" << AnalysisCache << ")\n";
+            }
             errs() << "-------Finished Path Profiling----------\n\n";
 
             return true;
@@ -73,52 +311,133 @@ namespace {
             std::vector<BasicBlock*> bbDomSet;
             for (auto &BB: F) {
                 BB.setName("b");
-                // set the start node dominator set to itself
+                bbDomSet.push_back(&BB);
+            }
+            for (auto &BB: F) {
                 if (BB.getName().equals("b")) {
-                    bbDomSet.push_back(&BB);
-                    domSet.push_back(bbDomSet);
+                    BB.setName("b0");
                 }
-                else {
-                    bbDomSet.push_back(&BB);
+            }
+
+            std::map<StringRef, GlobalVariable*> cfgRows;
+            Type *i32 = Type::getInt32Ty(*Context);
+            auto cfgRow = [&](StringRef name, uint32_t value) {
+                cfgRows[name] = new GlobalVariable(*F.getParent(), i32, false, GlobalValue::InternalLinkage, ConstantInt::get(i32, value), "cfg." + F.getName() + "." + name);
+            };
+            cfgRow("checksum", cs201::cfgChecksum(F));
+            for (auto &BB: F) {
+                cfgRow(BB.getName(), cs201::blockAnchor(BB));
+            }
+            _CFGROWS[F.getName()] = cfgRows;
+            describeCounters(F, "cfg", cfgRows);
+
+            // a function whose CFG was seen before takes the results from the cache
+            std::vector<std::vector<unsigned>> implied;
+            std::vector<unsigned> shared;
+            bool cached = !AnalysisCache.empty() && loadAnalysis(F, implied, shared);
+            if (!cached) {
+                // set the start node dominator set to itself and the other
+                // nodes dominator sets to all nodes in the CFG
+                domSet.assign(func_size, bbDomSet);
+                domSet.at(0) = std::vector<BasicBlock*>(1, &F.getEntryBlock());
+				// Find Dominatoe sets
+				bool change= true;
+				while (change){
+					std::vector<std::vector<BasicBlock*>> oldDomSet=domSet;
+					change=false;
+					for (auto &BB: F) {
+                        findDomSet(BB);
+                    }
+                    change=!compare(oldDomSet,domSet);
+
                 }
+                // find back edges & loops
+                for (auto &BB: F) {
+					findBackEdges(BB);
+					findLoops(BB);
+				}
             }
 
-            // set the other nodes dominator sets to all nodes in the CFG
+            bool computed = false;
+            if (ProfileCoverage != CoverageOff && implied.empty()) {
+                findPostDomSets(F);
+                implied = chooseCoverageProbes(F);
+                computed = true;
+            }
+            else if (ProfileCoverage == CoverageOff && ProfileShareCounters && shared.empty()) {
+                findPostDomSets(F);
+                shared = findControlEquivalence(F);
+                computed = true;
+            }
+            if (!AnalysisCache.empty() && (!cached || computed)) {
+                saveAnalysis(F, implied, shared);
+            }
 
-            for (auto &BB: F) {
-                if (BB.getName().equals("b")) {
-                    BB.setName("b0");
-                    continue;
+            if (ProfileCoverage != CoverageOff) {
+                unsigned numEdges = 0;
+                for (auto &BB: F) {
+                    numEdges += BB.getTerminator()->getNumSuccessors();
+                }
+                unsigned slots = func_size + numEdges;
+                unsigned bytes = ProfileCoverage == CoverageBit ? (slots + 7) / 8 : slots;
+                ArrayType *mapTy = ArrayType::get(Type::getInt8Ty(*Context), bytes);
+                covMap = new GlobalVariable(*F.getParent(), mapTy, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(mapTy), "covMap");
+                covSlots = func_size;
+                for (auto &BB: F) {
+                    unsigned bnum = BBNum(BB.getName());
+                    bbCounters[BB.getName()] = covMap;
+                    coverageSlots[BB.getName()] = {bnum, implied.at(bnum)};
+                    if (implied.at(bnum).empty()) {
+                        runOnCoverageProbe(BB, bnum);
+                    }
                 }
-                domSet.push_back(bbDomSet);
             }
-			// Find Dominatoe sets
-			bool change= true;
-			while (change){
-				std::vector<std::vector<BasicBlock*>> oldDomSet=domSet;
-				change=false;
-				for (auto &BB: F) {
-                    findDomSet(BB);
+            else {
+                // a block control-equivalent to a dominator prints that dominator's counter
+                unsigned numShared = 0;
+                for (auto &BB: F) {
+                    unsigned bnum = BBNum(BB.getName());
+                    if (ProfileShareCounters && shared.at(bnum) != bnum) {
+                        ++numShared;
+                        continue;
+                    }
+                    GlobalVariable *bbCounter = new GlobalVariable(*BB.getParent()->getParent(), Type::getInt32Ty(*Context), false, GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt32Ty(*Context), 0), "bbCounter");
+                    bbCounters[BB.getName()] = bbCounter;
+                    runOnBasicBlock(BB);
                 }
-                change=!compare(oldDomSet,domSet);
-
+                if (numShared) {
+                    for (auto &BB: F) {
+                        unsigned bnum = BBNum(BB.getName());
+                        bbCounters[BB.getName()] = bbCounters[bbDomSet.at(shared.at(bnum))->getName()];
+                    }
+                    errs() << "Shared counters: " << numShared << " of " << func_size << " blocks\n";
+                }
+                sharedBlocks += numShared;
+                countedBlocks += func_size;
             }
-            // find back edges & loops
-            for (auto &BB: F) {
-				findBackEdges(BB);
-				findLoops(BB);
-			}
 
-            for (auto &BB: F) {
-                GlobalVariable *bbCounter = new GlobalVariable(*BB.getParent()->getParent(), Type::getInt32Ty(*Context), false, GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt32Ty(*Context), 0), "bbCounter");
-                bbCounters[BB.getName()] = bbCounter;
-                runOnBasicBlock(BB);
+            if (LoopPaths) {
+                planLoopPaths(F);
             }
 
-            // Add edge block and set the counter for each edge
+            // Add edge block and set the counter for each edge; landing pad
+            // splitting inserts blocks mid-function, so walk a snapshot
+            std::vector<BasicBlock*> blocks;
             for (unsigned i = 0; i < func_size; ++i) {
-                initEdges(it);
-                it++;
+                blocks.push_back(&*it++);
+            }
+            for (BasicBlock *BB: blocks) {
+                initEdges(BB);
+            }
+
+            if (ProfileTiming) {
+                instrumentTiming(F);
+            }
+            if (LoopPaths) {
+                instrumentLoopPaths(F);
+            }
+            if (ProfileAlloc) {
+                instrumentAllocations(F);
             }
 
             errs() << "Dominator Sets:\n";
@@ -162,17 +481,39 @@ namespace {
             _BBCOUNTERS[F.getName()] = bbCounters;
             _LOOPS[F.getName()] = loops;
             _EDGECOUNTERS[F.getName()] = edgeCounters;
+            if (ProfileCoverage != CoverageOff) {
+                _COVERAGESLOTS[F.getName()] = coverageSlots;
+                _COVERAGEMAPS[F.getName()] = covMap;
+            }
+            else {
+                describeCounters(F, "block", bbCounters);
+                describeCounters(F, "edge", edgeCounters);
+                describeLoops(F);
+            }
 
             domSet.clear();
             backEdges.clear();
             loops.clear();
             bbCounters.clear();
             edgeCounters.clear();
+            edgeBlocks.clear();
+            restPads.clear();
+            loopPlans.clear();
+            postDomSet.clear();
+            reachesExit.clear();
+            coverageSlots.clear();
 
 			for (auto &BB: F) {
                 // Add the footer to Main's BB containing the return 0; statement BEFORE calling runOnBasicBlock
                 if(F.getName().equals("main") && isa<ReturnInst>(BB.getTerminator())) { // major hack?
-                    addFinalPrintf(BB, Context, bbCounters, BasicBlockPrintfFormatStr, printf_func);
+                    if (ProfileCoverage != CoverageOff) {
+                        addCoverageFixup(BB);
+                    }
+                    // with -profile-file the runtime writes the profile at exit instead
+                    if (ProfileDump && ProfileFile.empty()) {
+                        addFinalPrintf(BB);
+                    }
+                    addRuntimeDumps(BB);
                 }
             }
             return true; // since runOnBasicBlock has modified the program
@@ -314,6 +655,169 @@ namespace {
             return true;
 		}
 
+        // The analyses depend only on the successor lists, so those are the
+        // cache key. The entry repeats them, which rules out hash collisions.
+        std::string cfgShape(Function &F) {
+            std::string shape = "blocks " + std::to_string(F.size()) + "\n";
+            for (auto &BB: F) {
+                shape += "succ";
+                for (auto it = succ_begin(&BB), et = succ_end(&BB); it != et; ++it) {
+                    shape += " " + std::to_string(BBNum((*it)->getName()));
+                }
+                shape += "\n";
+            }
+            return shape;
+        }
+
+        std::string cachePath(StringRef shape) {
+            return AnalysisCache + "/" + utohexstr(moduleHash(shape)) + ".cfg";
+        }
+
+        // "3 5 7" -> block numbers below limit
+        static bool parseNumbers(StringRef text, unsigned limit, std::vector<unsigned> &numbers) {
+            SmallVector<StringRef, 16> fields;
+            text.split(fields, " ", -1, false);
+            for (StringRef field: fields) {
+                unsigned n;
+                if (field.getAsInteger(10, n) || n >= limit) {
+                    return false;
+                }
+                numbers.push_back(n);
+            }
+            return true;
+        }
+
+        // Fills domSet, backEdges, loops and, if the entry has them, the
+        // coverage implications and counter sharing from the cache. False on
+        // a miss.
+        bool loadAnalysis(Function &F, std::vector<std::vector<unsigned>> &implied, std::vector<unsigned> &shared) {
+            std::string shape = cfgShape(F);
+            ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(cachePath(shape));
+            if (!buffer || !buffer.get()->getBuffer().startswith(shape)) {
+                ++cacheMisses;
+                return false;
+            }
+            std::vector<BasicBlock*> blocks;
+            for (auto &BB: F) {
+                blocks.push_back(&BB);
+            }
+            unsigned n = blocks.size();
+            std::vector<std::vector<BasicBlock*>> doms(n);
+            std::map<StringRef, std::vector<BasicBlock*>> back;
+            std::map<StringRef, std::vector<std::vector<BasicBlock*>>> loopSets;
+            std::vector<std::vector<unsigned>> probes;
+            std::vector<unsigned> reps;
+            // findBackEdges leaves an entry for every block
+            for (BasicBlock *BB: blocks) {
+                back[BB->getName()];
+            }
+            for (line_iterator line(*buffer.get()); !line.is_at_eof(); ++line) {
+                std::pair<StringRef, StringRef> parts = line->split(':');
+                std::vector<unsigned> key, values;
+                StringRef kind = parts.first.split(' ').first;
+                if (kind == "blocks" || kind == "succ") {
+                    continue;
+                }
+                if (!parseNumbers(parts.first.split(' ').second, n, key) || !parseNumbers(parts.second, n, values)) {
+                    ++cacheMisses;
+                    return false;
+                }
+                std::vector<BasicBlock*> set;
+                for (unsigned v: values) {
+                    set.push_back(blocks.at(v));
+                }
+                if (kind == "dom" && key.size() == 1) {
+                    doms.at(key[0]) = set;
+                }
+                else if (kind == "back" && key.size() == 2) {
+                    back[blocks.at(key[0])->getName()].push_back(blocks.at(key[1]));
+                    loopSets[blocks.at(key[0])->getName()].push_back(set);
+                }
+                else if (kind == "implied" && key.size() == 1) {
+                    probes.resize(n);
+                    probes.at(key[0]) = values;
+                }
+                else if (kind == "shared" && key.size() == 1 && values.size() == 1) {
+                    reps.resize(n);
+                    reps.at(key[0]) = values[0];
+                }
+                else {
+                    ++cacheMisses;
+                    return false;
+                }
+            }
+            domSet = doms;
+            backEdges = back;
+            loops = loopSets;
+            implied = probes;
+            shared = reps;
+            ++cacheHits;
+            return true;
+        }
+
+        // written to a temporary file and renamed, so parallel builds sharing
+        // the directory never read half an entry. The implied and shared lines
+        // this run did not compute are carried over from the entry on disk, or
+        // coverage and shared-counter builds would keep evicting each other's.
+        void saveAnalysis(Function &F, std::vector<std::vector<unsigned>> &implied, std::vector<unsigned> &shared) {
+            std::string shape = cfgShape(F);
+            std::string path = cachePath(shape);
+            std::string kept;
+            ErrorOr<std::unique_ptr<MemoryBuffer>> old = MemoryBuffer::getFile(path);
+            if (old && old.get()->getBuffer().startswith(shape)) {
+                for (line_iterator line(*old.get()); !line.is_at_eof(); ++line) {
+                    if ((implied.empty() && line->startswith("implied ")) || (shared.empty() && line->startswith("shared "))) {
+                        kept += line->str();
+                        kept += '\n';
+                    }
+                }
+            }
+            int fd;
+            SmallString<128> tmp;
+            if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmp)) {
+                return;
+            }
+            {
+                raw_fd_ostream out(fd, true);
+                out << shape;
+                for (unsigned i = 0; i < domSet.size(); ++i) {
+                    out << "dom " << i << ":";
+                    for (BasicBlock *BB: domSet.at(i)) {
+                        out << ' ' << BBNum(BB->getName());
+                    }
+                    out << '\n';
+                }
+                for (auto &BB: F) {
+                    auto back = backEdges.find(BB.getName());
+                    auto loop = loops.find(BB.getName());
+                    if (back == backEdges.end() || loop == loops.end()) {
+                        continue;
+                    }
+                    for (unsigned k = 0; k < back->second.size(); ++k) {
+                        out << "back " << BBNum(BB.getName()) << ' ' << BBNum(back->second.at(k)->getName()) << ":";
+                        for (BasicBlock *node: loop->second.at(k)) {
+                            out << ' ' << BBNum(node->getName());
+                        }
+                        out << '\n';
+                    }
+                }
+                for (unsigned i = 0; i < implied.size(); ++i) {
+                    out << "implied " << i << ":";
+                    for (unsigned dep: implied.at(i)) {
+                        out << ' ' << dep;
+                    }
+                    out << '\n';
+                }
+                for (unsigned i = 0; i < shared.size(); ++i) {
+                    out << "shared " << i << ": " << shared.at(i) << '\n';
+                }
+                out << kept;
+            }
+            if (sys::fs::rename(tmp, path)) {
+                sys::fs::remove(tmp);
+            }
+        }
+
         void Insert(BasicBlock *BB, std::vector<BasicBlock*> &stack, std::vector<BasicBlock*> &loopNodes) {
             if (std::find(loopNodes.begin(), loopNodes.end(), BB) == loopNodes.end()) {
                 loopNodes.push_back(BB);
@@ -322,25 +826,96 @@ namespace {
             return;
         }
 
+        // Insert a block on each edge. The PHIs in succ take the edge block in
+        // place of BB; an unwind edge gets its own landing pad from
+        // SplitLandingPadPredecessors; an indirectbr edge cannot be redirected
+        // (its targets are block addresses) and is counted in succ instead.
         void initEdges(BasicBlock *BB) {
-            // insert a basicblock in each edge
             TerminatorInst *term = BB->getTerminator();
             unsigned n = term->getNumSuccessors();
-            // set BB's successor to the newly created block edgeBB and edgeBB's successor to succ
+            std::set<BasicBlock*> seen;
             for (unsigned i = 0; i < n; ++i) {
                 BasicBlock *succ = term->getSuccessor(i);
-                std::string edgeStr = BB->getName().str() + " -> " + succ->getName().str();
-                StringRef edgeName = StringRef(edgeStr);
+                auto rest = restPads.find(succ);
+                BasicBlock *target = rest == restPads.end() ? succ : rest->second;
+                std::string edgeStr = BB->getName().str() + " -> " + target->getName().str();
+                if (isa<IndirectBrInst>(term)) {
+                    // a target listed twice is still one edge
+                    if (seen.insert(succ).second) {
+                        runOnSuccessorEdge(*BB, *succ, edgeStr);
+                    }
+                    continue;
+                }
 
-                BasicBlock *edgeBB = BasicBlock::Create(*Context, edgeName, BB->getParent());
-                term->setSuccessor(i, edgeBB);
-                BranchInst::Create(succ, edgeBB);
+                BasicBlock *edgeBB;
+                if (succ->isLandingPad()) {
+                    SmallVector<BasicBlock*, 2> pads;
+                    SplitLandingPadPredecessors(succ, BB, ".edge", ".rest", pads);
+                    edgeBB = pads[0];
+                    edgeBB->setName(edgeStr);
+                    if (pads.size() > 1) {
+                        restPads[pads[1]] = target;
+                    }
+                }
+                else {
+                    edgeBB = BasicBlock::Create(*Context, edgeStr, BB->getParent());
+                    term->setSuccessor(i, edgeBB);
+                    BranchInst::Create(succ, edgeBB);
+                    // one incoming entry per edge, so a duplicate edge (a switch
+                    // with two cases to succ) moves the next entry still on BB
+                    for (auto I = succ->begin(); isa<PHINode>(I); ++I) {
+                        PHINode *PN = cast<PHINode>(I);
+                        int index = PN->getBasicBlockIndex(BB);
+                        if (index >= 0) {
+                            PN->setIncomingBlock(index, edgeBB);
+                        }
+                    }
+                }
+                edgeBlocks.insert(std::make_pair(std::make_pair(BB, target), edgeBB));
 
                 runOnEdges(*edgeBB);
             }
         }
 
+        // Count BB -> succ at the top of succ: a PHI is 1 when control came
+        // from BB and 0 from any other predecessor, and is added to the counter.
+        void runOnSuccessorEdge(BasicBlock &BB, BasicBlock &succ, const std::string &edgeStr) {
+            successorEdgeNames.push_back(edgeStr);
+            StringRef edgeName = successorEdgeNames.back();
+            IRBuilder<> phiIRB(&succ, succ.begin());
+            Type *i32 = Type::getInt32Ty(*Context);
+            PHINode *fromBB = phiIRB.CreatePHI(i32, 2, "fromEdge");
+            for (auto PI = pred_begin(&succ), E = pred_end(&succ); PI != E; ++PI) {
+                fromBB->addIncoming(ConstantInt::get(i32, *PI == &BB), *PI);
+            }
+            IRBuilder<> IRB(succ.getFirstInsertionPt());
+            if (ProfileCoverage != CoverageOff) {
+                edgeCounters[edgeName] = covMap;
+                coverageSlots[edgeName] = {covSlots, {}};
+                unsigned slot = covSlots++;
+                unsigned byte = ProfileCoverage == CoverageBit ? slot / 8 : slot;
+                std::vector<Constant*> indices = {ConstantInt::get(i32, 0), ConstantInt::get(i32, byte)};
+                Constant *addr = ConstantExpr::getGetElementPtr(covMap, indices);
+                Value *bit = IRB.CreateTrunc(fromBB, Type::getInt8Ty(*Context));
+                if (ProfileCoverage == CoverageBit) {
+                    bit = IRB.CreateShl(bit, slot % 8);
+                }
+                IRB.CreateStore(IRB.CreateOr(IRB.CreateLoad(addr), bit), addr);
+                return;
+            }
+            GlobalVariable *edgeCounter = new GlobalVariable(*succ.getParent()->getParent(), i32, false, GlobalValue::InternalLinkage, ConstantInt::get(i32, 0), "edgeCounter");
+            edgeCounters[edgeName] = edgeCounter;
+            Value *loadAddr = IRB.CreateLoad(edgeCounter);
+            IRB.CreateStore(IRB.CreateAdd(fromBB, loadAddr), edgeCounter);
+        }
+
         void runOnEdges(BasicBlock &BB) {
+            if (ProfileCoverage != CoverageOff) {
+                edgeCounters[BB.getName()] = covMap;
+                coverageSlots[BB.getName()] = {covSlots, {}};
+                runOnCoverageProbe(BB, covSlots++);
+                return;
+            }
             GlobalVariable *edgeCounter = new GlobalVariable(*BB.getParent()->getParent(), Type::getInt32Ty(*Context), false, GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt32Ty(*Context), 0), "edgeCounter");
             edgeCounters[BB.getName()] = edgeCounter;
             IRBuilder<> IRB(BB.getFirstInsertionPt()); // Will insert the generated instructions BEFORE the first BB instruction
@@ -352,94 +927,968 @@ namespace {
             return;
         }
 
+        // A byte probe is a single store; a bit probe has to read-modify-write its byte.
+        void runOnCoverageProbe(BasicBlock &BB, unsigned slot) {
+            IRBuilder<> IRB(BB.getFirstInsertionPt());
+            Type *i8 = Type::getInt8Ty(*Context);
+            unsigned byte = ProfileCoverage == CoverageBit ? slot / 8 : slot;
+            std::vector<Constant*> indices = {ConstantInt::get(Type::getInt32Ty(*Context), 0), ConstantInt::get(Type::getInt32Ty(*Context), byte)};
+            Constant *addr = ConstantExpr::getGetElementPtr(covMap, indices);
+            if (ProfileCoverage == CoverageBit) {
+                Value *bits = IRB.CreateLoad(addr);
+                IRB.CreateStore(IRB.CreateOr(bits, ConstantInt::get(i8, 1 << (slot % 8))), addr);
+            }
+            else {
+                IRB.CreateStore(ConstantInt::get(i8, 1), addr);
+            }
+        }
+
+        // same fixed point as the dominator sets, but over successors from the exit blocks
+        void findPostDomSets(Function &F) {
+            std::vector<BasicBlock*> all;
+            std::vector<BasicBlock*> work;
+            for (auto &BB: F) {
+                all.push_back(&BB);
+            }
+            postDomSet.assign(all.size(), all);
+            reachesExit.assign(all.size(), false);
+            for (auto &BB: F) {
+                if (succ_begin(&BB) == succ_end(&BB)) {
+                    postDomSet.at(BBNum(BB.getName())) = {&BB};
+                    reachesExit.at(BBNum(BB.getName())) = true;
+                    work.push_back(&BB);
+                }
+            }
+            while (!work.empty()) {
+                BasicBlock *BB = work.back();
+                work.pop_back();
+                for (auto it = pred_begin(BB), et = pred_end(BB); it != et; ++it) {
+                    if (!reachesExit.at(BBNum((*it)->getName()))) {
+                        reachesExit.at(BBNum((*it)->getName())) = true;
+                        work.push_back(*it);
+                    }
+                }
+            }
+
+            bool change = true;
+            while (change) {
+                change = false;
+                for (auto &BB: F) {
+                    if (succ_begin(&BB) == succ_end(&BB)) {
+                        continue;
+                    }
+                    std::vector<BasicBlock*> result = all;
+                    for (auto it = succ_begin(&BB), et = succ_end(&BB); it != et; ++it) {
+                        std::vector<BasicBlock*> &set = postDomSet.at(BBNum((*it)->getName()));
+                        std::vector<BasicBlock*> inter;
+                        std::set_intersection(result.begin(), result.end(), set.begin(), set.end(), std::back_inserter(inter), [this](BasicBlock *a, BasicBlock *b) { return BBNum(a->getName()) < BBNum(b->getName()); });
+                        result = inter;
+                    }
+                    auto pos = std::lower_bound(result.begin(), result.end(), &BB, [this](BasicBlock *a, BasicBlock *b) { return BBNum(a->getName()) < BBNum(b->getName()); });
+                    if (pos == result.end() || *pos != &BB) {
+                        result.insert(pos, &BB);
+                    }
+                    if (result != postDomSet.at(BBNum(BB.getName()))) {
+                        postDomSet.at(BBNum(BB.getName())) = result;
+                        change = true;
+                    }
+                }
+            }
+        }
+
+        bool dominates(BasicBlock *A, BasicBlock *B) {
+            std::vector<BasicBlock*> &set = domSet.at(BBNum(B->getName()));
+            return std::find(set.begin(), set.end(), A) != set.end();
+        }
+
+        bool postDominates(BasicBlock *A, BasicBlock *B) {
+            std::vector<BasicBlock*> &set = postDomSet.at(BBNum(B->getName()));
+            return reachesExit.at(BBNum(B->getName())) && std::find(set.begin(), set.end(), A) != set.end();
+        }
+
+        // B runs exactly as often as its immediate dominator A when B
+        // post-dominates A and no cycle passes through one without the other.
+        // Such blocks form chains down the dominator tree; each block gets the
+        // number of the top of its chain, itself if it needs its own counter.
+        // (Only immediate dominators are tried, so a chain broken by a loop in
+        // between is missed; that costs a counter, never a wrong count.)
+        std::vector<unsigned> findControlEquivalence(Function &F) {
+            unsigned n = F.size();
+            std::vector<BasicBlock*> blocks;
+            for (auto &BB: F) {
+                blocks.push_back(&BB);
+            }
+            std::vector<bool> onCycle(n, false);
+            for (scc_iterator<Function*> scc = scc_begin(&F); !scc.isAtEnd(); ++scc) {
+                if (scc.hasLoop()) {
+                    for (BasicBlock *BB: *scc) {
+                        onCycle.at(BBNum(BB->getName())) = true;
+                    }
+                }
+            }
+            std::vector<bool> reachable(n, false);
+            std::vector<BasicBlock*> work(1, &F.getEntryBlock());
+            reachable.at(0) = true;
+            while (!work.empty()) {
+                BasicBlock *BB = work.back();
+                work.pop_back();
+                for (auto it = succ_begin(BB), et = succ_end(BB); it != et; ++it) {
+                    if (!reachable.at(BBNum((*it)->getName()))) {
+                        reachable.at(BBNum((*it)->getName())) = true;
+                        work.push_back(*it);
+                    }
+                }
+            }
+
+            // a dominator has a smaller dominator set, so it is settled first
+            std::vector<unsigned> order;
+            for (unsigned b = 0; b < n; ++b) {
+                order.push_back(b);
+            }
+            std::stable_sort(order.begin(), order.end(), [this](unsigned a, unsigned b) { return domSet.at(a).size() < domSet.at(b).size(); });
+            std::vector<unsigned> shared(n);
+            for (unsigned b: order) {
+                shared.at(b) = b;
+                if (b == 0 || !reachable.at(b)) {
+                    continue;
+                }
+                BasicBlock *idom = NULL;
+                for (BasicBlock *dom: domSet.at(b)) {
+                    if (domSet.at(BBNum(dom->getName())).size() + 1 == domSet.at(b).size()) {
+                        idom = dom;
+                        break;
+                    }
+                }
+                if (!idom || !postDominates(blocks.at(b), idom)) {
+                    continue;
+                }
+                if ((onCycle.at(b) || onCycle.at(BBNum(idom->getName()))) && (cycleAvoiding(blocks.at(b), idom) || cycleAvoiding(idom, blocks.at(b)))) {
+                    continue;
+                }
+                shared.at(b) = shared.at(BBNum(idom->getName()));
+            }
+            return shared;
+        }
+
+        // is there a path from BB back to BB that does not pass through avoid
+        bool cycleAvoiding(BasicBlock *BB, BasicBlock *avoid) {
+            std::set<BasicBlock*> seen;
+            std::vector<BasicBlock*> work(1, BB);
+            while (!work.empty()) {
+                BasicBlock *cur = work.back();
+                work.pop_back();
+                for (auto it = succ_begin(cur), et = succ_end(cur); it != et; ++it) {
+                    if (*it == BB) {
+                        return true;
+                    }
+                    if (*it != avoid && seen.insert(*it).second) {
+                        work.push_back(*it);
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Skip the probe of a block that dominates all its successors (it ran iff
+        // one of them ran) or post-dominates all of its several predecessors (it
+        // ran iff one of them ran). A block used to imply another keeps its probe,
+        // so every implied set refers to real probes only.
+        std::vector<std::vector<unsigned>> chooseCoverageProbes(Function &F) {
+            std::vector<std::vector<unsigned>> implied(F.size());
+            std::vector<bool> pinned(F.size(), false);
+            pinned.at(0) = true;
+            for (auto &BB: F) {
+                unsigned bnum = BBNum(BB.getName());
+                if (pinned.at(bnum)) {
+                    continue;
+                }
+                std::vector<unsigned> deps;
+                bool fullDom = succ_begin(&BB) != succ_end(&BB);
+                for (auto it = succ_begin(&BB), et = succ_end(&BB); it != et; ++it) {
+                    unsigned snum = BBNum((*it)->getName());
+                    if (*it == &BB || !dominates(&BB, *it) || !implied.at(snum).empty()) {
+                        fullDom = false;
+                        break;
+                    }
+                    deps.push_back(snum);
+                }
+                if (!fullDom) {
+                    deps.clear();
+                    bool fullPostDom = !BB.getSinglePredecessor() && pred_begin(&BB) != pred_end(&BB);
+                    for (auto it = pred_begin(&BB), et = pred_end(&BB); fullPostDom && it != et; ++it) {
+                        unsigned pnum = BBNum((*it)->getName());
+                        if (*it == &BB || !postDominates(&BB, *it) || !implied.at(pnum).empty()) {
+                            fullPostDom = false;
+                        }
+                        deps.push_back(pnum);
+                    }
+                    if (!fullPostDom) {
+                        continue;
+                    }
+                }
+                std::sort(deps.begin(), deps.end());
+                deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+                for (unsigned dep: deps) {
+                    pinned.at(dep) = true;
+                }
+                implied.at(bnum) = deps;
+            }
+            return implied;
+        }
+
+        // !cs201.counters = !{!{kind, function, name, counter}, ...} lets a tool
+        // that runs the module in-process read the counters (tools/cs201-run)
+        void describeCounters(Function &F, StringRef kind, std::map<StringRef, GlobalVariable*> &counters) {
+            for (auto it = counters.begin(); it != counters.end(); ++it) {
+                describeCounter(F, kind, it->first, it->second);
+            }
+        }
+
+        // loop rows are named by their blocks and read the back edge's counter
+        void describeLoops(Function &F) {
+            for (auto it = loops.begin(); it != loops.end(); ++it) {
+                for (unsigned i = 0; i < it->second.size(); ++i) {
+                    auto counter = edgeCounters.find(backEdgeName(it->second.at(i)));
+                    if (counter != edgeCounters.end()) {
+                        describeCounter(F, "loop", loopName(it->second.at(i)), counter->second);
+                    }
+                }
+            }
+        }
+
+        void describeCounter(Function &F, StringRef kind, StringRef name, GlobalVariable *counter) {
+            NamedMDNode *desc = F.getParent()->getOrInsertNamedMetadata("cs201.counters");
+            Metadata *ops[] = {MDString::get(*Context, kind), MDString::get(*Context, F.getName()), MDString::get(*Context, name), ValueAsMetadata::get(counter)};
+            desc->addOperand(MDNode::get(*Context, ops));
+        }
+
+        // "b1 b2 b3" for the LOOP PROFILING section; the loop ends at its latch
+        std::string loopName(const std::vector<BasicBlock*> &loop) {
+            std::string str;
+            for (unsigned j = 0; j < loop.size(); ++j) {
+                str += loop.at(j)->getName();
+                if (j != loop.size()-1) {
+                    str += " ";
+                }
+            }
+            return str;
+        }
+
+        std::string backEdgeName(const std::vector<BasicBlock*> &loop) {
+            return loop.back()->getName().str() + " -> " + loop.front()->getName().str();
+        }
+
+        Constant* createNameString(Module *M, StringRef str, const char *varName) {
+            Constant *name = ConstantDataArray::getString(*Context, str);
+            GlobalVariable *var = new GlobalVariable(*M, llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), str.size()+1), true, llvm::GlobalValue::PrivateLinkage, name, varName);
+            Constant *zero = Constant::getNullValue(IntegerType::getInt32Ty(*Context));
+            std::vector<Constant*> indices = {zero, zero};
+            return ConstantExpr::getGetElementPtr(var, indices);
+        }
+
+        // the natural loops of all back edges sharing a header, merged
+        std::map<BasicBlock*, std::vector<BasicBlock*>> loopBodies() {
+            std::map<BasicBlock*, std::vector<BasicBlock*>> headers;
+            for (auto it = backEdges.begin(); it != backEdges.end(); ++it) {
+                for (unsigned i = 0; i < it->second.size(); ++i) {
+                    std::vector<BasicBlock*> &body = headers[it->second.at(i)];
+                    for (BasicBlock *node : loops[it->first].at(i)) {
+                        if (std::find(body.begin(), body.end(), node) == body.end()) {
+                            body.push_back(node);
+                        }
+                    }
+                }
+            }
+            return headers;
+        }
+
+        // Timing regions: the function itself plus one region per loop header.
+        // Entry/exit probes go into the edge blocks made by initEdges, so this
+        // must run after them and before backEdges/loops are cleared.
+        void instrumentTiming(Function &F) {
+            Module *M = F.getParent();
+            Type *i32 = Type::getInt32Ty(*Context);
+
+            unsigned funcId = timingRegions++;
+            IRBuilder<> entry(F.getEntryBlock().getFirstInsertionPt());
+            entry.CreateCall(timingEnterFunc, {ConstantInt::get(i32, funcId), createNameString(M, F.getName(), "tName")});
+            for (auto &BB: F) {
+                if (isa<ReturnInst>(BB.getTerminator())) {
+                    IRBuilder<> IRB(BB.getTerminator());
+                    IRB.CreateCall(timingExitFunc, ConstantInt::get(i32, funcId));
+                }
+            }
+
+            std::map<BasicBlock*, std::vector<BasicBlock*>> headers = loopBodies();
+
+            // outermost loops first, so an edge leaving several loops closes the inner one first
+            std::vector<std::pair<BasicBlock*, std::vector<BasicBlock*>>> regions(headers.begin(), headers.end());
+            std::stable_sort(regions.begin(), regions.end(), [](const std::pair<BasicBlock*, std::vector<BasicBlock*>> &a, const std::pair<BasicBlock*, std::vector<BasicBlock*>> &b) {
+                return a.second.size() > b.second.size();
+            });
+            std::vector<unsigned> ids;
+            for (auto &region: regions) {
+                ids.push_back(timingRegions++);
+                std::string name = F.getName().str() + ": loop " + region.first->getName().str();
+                Constant *loopName = createNameString(M, name, "tName");
+                for (auto it = edgeBlocks.begin(); it != edgeBlocks.end(); ++it) {
+                    std::vector<BasicBlock*> &body = region.second;
+                    bool fromInside = std::find(body.begin(), body.end(), it->first.first) != body.end();
+                    if (!fromInside && it->first.second == region.first) {
+                        IRBuilder<> IRB(it->second->getTerminator());
+                        IRB.CreateCall(timingEnterFunc, {ConstantInt::get(i32, ids.back()), loopName});
+                    }
+                }
+            }
+            for (unsigned r = regions.size(); r-- > 0; ) {
+                std::vector<BasicBlock*> &body = regions[r].second;
+                for (auto it = edgeBlocks.begin(); it != edgeBlocks.end(); ++it) {
+                    bool fromInside = std::find(body.begin(), body.end(), it->first.first) != body.end();
+                    bool toInside = std::find(body.begin(), body.end(), it->first.second) != body.end();
+                    if (fromInside && !toInside) {
+                        IRBuilder<> IRB(it->second->getTerminator());
+                        IRB.CreateCall(timingExitFunc, ConstantInt::get(i32, ids.at(r)));
+                    }
+                }
+            }
+        }
+
         //----------------------------------
-        // Rest of this code is needed to: printf("%d\n", bbCounter); to the end of main, just BEFORE the return statement
-        // For this, prepare the SCCGraph, and append to last BB?
-        void addFinalPrintf(BasicBlock& BB, LLVMContext *Context, std::map<StringRef, GlobalVariable*> bbCounters, GlobalVariable *var, Function *printf_func) {
-            IRBuilder<> builder(BB.getTerminator()); // Insert BEFORE the final statement
-            std::vector<Constant*> indices;
+        // Number the paths through one iteration of every loop. Runs on the
+        // CFG before initEdges; instrumentLoopPaths then places the increments
+        // in the edge blocks.
+        void planLoopPaths(Function &F) {
+            std::map<BasicBlock*, std::vector<BasicBlock*>> bodies = loopBodies();
+            for (auto &loop: bodies) {
+                std::vector<BasicBlock*> &body = loop.second;
+                LoopPathPlan plan;
+                plan.header = loop.first;
+                auto inside = [&body](BasicBlock *B) {
+                    return std::find(body.begin(), body.end(), B) != body.end();
+                };
+
+                // every block stands for itself or for the largest inner loop holding it
+                std::map<BasicBlock*, BasicBlock*> rep;
+                std::map<BasicBlock*, size_t> repSize;
+                bool indirect = false;
+                for (BasicBlock *B: body) {
+                    rep[B] = B;
+                    indirect |= isa<IndirectBrInst>(B->getTerminator());
+                }
+                if (indirect) {
+                    errs() << "Loop paths: skipping loop " << plan.header->getName() << " (indirectbr edges)\n";
+                    continue;
+                }
+                for (auto &inner: bodies) {
+                    if (inner.first == plan.header || !inside(inner.first) || inner.second.size() >= body.size()) {
+                        continue;
+                    }
+                    plan.innerHeaders.push_back(inner.first);
+                    for (BasicBlock *B: inner.second) {
+                        if (repSize[B] < inner.second.size()) {
+                            rep[B] = inner.first;
+                            repSize[B] = inner.second.size();
+                        }
+                    }
+                }
+
+                std::map<BasicBlock*, std::vector<unsigned>> out;
+                for (BasicBlock *B: body) {
+                    BasicBlock *from = rep[B];
+                    for (auto S = succ_begin(B), E = succ_end(B); S != E; ++S) {
+                        std::pair<BasicBlock*, BasicBlock*> edge = std::make_pair(B, *S);
+                        if (plan.cfgEdges.count(edge)) {
+                            continue;
+                        }
+                        BasicBlock *to = NULL;
+                        std::string label = B->getName().str() + " -> " + (*S)->getName().str();
+                        if (*S != plan.header && inside(*S)) {
+                            to = rep[*S];
+                            if (to == from) {
+                                continue; // inside an inner loop
+                            }
+                            label.clear();
+                        }
+                        // CFG edges between the same two nodes are one DAG edge
+                        unsigned index = plan.dag.size();
+                        for (unsigned e: out[from]) {
+                            if (to && plan.dag.at(e).to == to) {
+                                index = e;
+                            }
+                        }
+                        if (index == plan.dag.size()) {
+                            plan.dag.push_back({from, to, label, 0});
+                            out[from].push_back(index);
+                        }
+                        plan.cfgEdges[edge] = index;
+                    }
+                }
+
+                std::map<BasicBlock*, unsigned> state;
+                std::vector<BasicBlock*> postOrder;
+                if (!pathPostOrder(plan.header, plan, out, state, postOrder)) {
+                    errs() << "Loop paths: skipping loop " << plan.header->getName() << " (irreducible body)\n";
+                    continue;
+                }
+                // Ball-Larus: an edge's increment is the number of paths from its
+                // source through the edges before it
+                std::map<BasicBlock*, uint64_t> numPaths;
+                bool overflow = false;
+                for (BasicBlock *node: postOrder) {
+                    uint64_t paths = 0;
+                    for (unsigned e: out[node]) {
+                        PathEdge &edge = plan.dag.at(e);
+                        edge.value = paths;
+                        paths += edge.to ? numPaths[edge.to] : 1;
+                    }
+                    numPaths[node] = paths;
+                    overflow |= paths > 0x7fffffff;
+                }
+                if (overflow) {
+                    errs() << "Loop paths: skipping loop " << plan.header->getName() << " (too many paths)\n";
+                    continue;
+                }
+                plan.numPaths = numPaths[plan.header];
+                plan.nodes.assign(postOrder.rbegin(), postOrder.rend());
+                errs() << "Loop paths: loop " << plan.header->getName() << ", " << plan.numPaths << " paths per iteration\n";
+                loopPlans.push_back(plan);
+            }
+        }
+
+        // post order of the collapsed loop body; false if it has a cycle
+        bool pathPostOrder(BasicBlock *node, LoopPathPlan &plan, std::map<BasicBlock*, std::vector<unsigned>> &out, std::map<BasicBlock*, unsigned> &state, std::vector<BasicBlock*> &postOrder) {
+            state[node] = 1;
+            for (unsigned e: out[node]) {
+                BasicBlock *to = plan.dag.at(e).to;
+                if (!to || state[to] == 2) {
+                    continue;
+                }
+                if (state[to] == 1 || !pathPostOrder(to, plan, out, state, postOrder)) {
+                    return false;
+                }
+            }
+            state[node] = 2;
+            postOrder.push_back(node);
+            return true;
+        }
+
+        // The path number lives in a stack slot per loop: zeroed at the top of
+        // the header, bumped on the edges, and handed to the runtime on every
+        // edge that ends an iteration.
+        void instrumentLoopPaths(Function &F) {
+            Module *M = F.getParent();
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+            IRBuilder<> entry(F.getEntryBlock().getFirstInsertionPt());
+            for (auto &plan: loopPlans) {
+                unsigned id = loopPathDescs.size();
+                AllocaInst *path = entry.CreateAlloca(i32, nullptr, "loopPath");
+                IRBuilder<> head(plan.header->getFirstInsertionPt());
+                head.CreateStore(ConstantInt::get(i32, 0), path);
+                for (auto it = plan.cfgEdges.begin(); it != plan.cfgEdges.end(); ++it) {
+                    PathEdge &edge = plan.dag.at(it->second);
+                    if (edge.to && edge.value == 0) {
+                        continue;
+                    }
+                    auto blocks = edgeBlocks.equal_range(it->first);
+                    for (auto block = blocks.first; block != blocks.second; ++block) {
+                        IRBuilder<> IRB(block->second->getTerminator());
+                        Value *sum = IRB.CreateAdd(IRB.CreateLoad(path), ConstantInt::get(i32, edge.value));
+                        if (edge.to) {
+                            IRB.CreateStore(sum, path);
+                        }
+                        else {
+                            bool exiting = it->first.second != plan.header;
+                            IRB.CreateCall(loopPathFunc, {ConstantInt::get(i32, id), sum, ConstantInt::get(i32, exiting)});
+                        }
+                    }
+                }
+
+                std::map<BasicBlock*, int> index;
+                std::vector<Constant*> nodeNames;
+                for (BasicBlock *node: plan.nodes) {
+                    index[node] = nodeNames.size();
+                    bool inner = std::find(plan.innerHeaders.begin(), plan.innerHeaders.end(), node) != plan.innerHeaders.end();
+                    nodeNames.push_back(createNameString(M, inner ? "[" + node->getName().str() + "]" : node->getName().str(), "lpNode"));
+                }
+                std::vector<Constant*> edges;
+                for (auto &edge: plan.dag) {
+                    if (!index.count(edge.from)) {
+                        continue;
+                    }
+                    Constant *label = edge.to ? Constant::getNullValue(i8Ptr) : createNameString(M, edge.label, "lpEdge");
+                    edges.push_back(ConstantStruct::get(pathEdgeTy, {ConstantInt::get(i32, index[edge.from]), ConstantInt::get(i32, edge.to ? index[edge.to] : -1), ConstantInt::get(i32, edge.value), label}));
+                }
+                std::string name = F.getName().str() + ": loop " + plan.header->getName().str();
+                loopPathDescs.push_back(ConstantStruct::get(loopDescTy, {createNameString(M, name, "lpName"), constantArray(M, i8Ptr, nodeNames, "lpNodes"), constantArray(M, pathEdgeTy, edges, "lpEdges"), ConstantInt::get(i32, edges.size()), ConstantInt::get(i32, plan.numPaths)}));
+            }
+        }
+
+        // pointer to the first element of a private constant array
+        Constant* constantArray(Module *M, Type *elementTy, std::vector<Constant*> &elements, const char *varName) {
+            ArrayType *arrayTy = ArrayType::get(elementTy, elements.size());
+            GlobalVariable *var = new GlobalVariable(*M, arrayTy, true, GlobalValue::PrivateLinkage, ConstantArray::get(arrayTy, elements), varName);
             Constant *zero = Constant::getNullValue(IntegerType::getInt32Ty(*Context));
-            indices.push_back(zero);
-            indices.push_back(zero);
-            //indices.push_back(zero);
-            Constant *var_ref = ConstantExpr::getGetElementPtr(var, indices);
-
-            /************************Basic Block Profiling*****************************/
-            const char* Bprofile = "BASIC BLOCK PROFILING:\n";
-            Constant *Bstr = ConstantDataArray::getString(*Context, Bprofile);
-            GlobalVariable *bbTitle = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), strlen(Bprofile)+1), true, llvm::GlobalValue::PrivateLinkage, Bstr, "bbTitle");
-            Constant *BBProfile = ConstantExpr::getGetElementPtr(bbTitle, indices);
-            CallInst *call0 = builder.CreateCall(printf_func, BBProfile);
-            call0->setTailCall(false);
+            std::vector<Constant*> indices = {zero, zero};
+            return ConstantExpr::getGetElementPtr(var, indices);
+        }
+
+        // a constructor hands the loop table to the runtime before main runs
+        void registerLoopPaths(Module &M) {
+            Type *voidTy = Type::getVoidTy(*Context);
+            Type *i32 = Type::getInt32Ty(*Context);
+            Function *initFunc = runtime_prototype(&M, "__cs201_loop_paths_init", FunctionType::get(voidTy, {loopDescTy->getPointerTo(), i32, i32, i32, i32}, false));
+            Function *ctor = Function::Create(FunctionType::get(voidTy, false), GlobalValue::InternalLinkage, "cs201.looppath.ctor", &M);
+            IRBuilder<> IRB(BasicBlock::Create(*Context, "entry", ctor));
+            Constant *table = constantArray(&M, loopDescTy, loopPathDescs, "cs201.loops");
+            IRB.CreateCall(initFunc, {table, ConstantInt::get(i32, loopPathDescs.size()), ConstantInt::get(i32, LoopPaths), ConstantInt::get(i32, LoopPathTable), ConstantInt::get(i32, LoopPathTop)});
+            IRB.CreateRetVoid();
+            appendToGlobalCtors(M, ctor, 0);
+        }
+
+        static AllocKind allocKind(StringRef name) {
+            return StringSwitch<AllocKind>(name)
+                .Cases("malloc", "_Znwm", "_Znam", "_Znwj", "_Znaj", AllocMalloc)
+                .Cases("_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t", AllocMalloc)
+                .Case("calloc", AllocCalloc)
+                .Case("realloc", AllocRealloc)
+                .Cases("free", "_ZdlPv", "_ZdaPv", "_ZdlPvm", "_ZdaPvm", AllocFree)
+                .Cases("_ZdlPvj", "_ZdaPvj", AllocFree)
+                .Default(NotAlloc);
+        }
+
+        // Report every allocation to the runtime with its site number, and
+        // every pointer handed back (free, delete, realloc) before it goes.
+        // Runs after initEdges, so an invoke of operator new has an edge block
+        // of its own to put the call in.
+        void instrumentAllocations(Function &F) {
+            Module *M = F.getParent();
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i64 = Type::getInt64Ty(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+
+            std::map<BasicBlock*, std::vector<BasicBlock*>> bodies = loopBodies();
+            std::map<BasicBlock*, BasicBlock*> innermost;
+            for (auto &loop: bodies) {
+                for (BasicBlock *B: loop.second) {
+                    auto it = innermost.find(B);
+                    if (it == innermost.end() || bodies[it->second].size() > loop.second.size()) {
+                        innermost[B] = loop.first;
+                    }
+                }
+            }
+
+            std::vector<Instruction*> calls;
+            for (auto &BB: F) {
+                for (auto &I: BB) {
+                    CallSite CS(&I);
+                    Function *callee = CS ? CS.getCalledFunction() : NULL;
+                    if (callee && allocKind(callee->getName()) != NotAlloc) {
+                        calls.push_back(&I);
+                    }
+                }
+            }
+            for (Instruction *I: calls) {
+                CallSite CS(I);
+                Function *callee = CS.getCalledFunction();
+                AllocKind kind = allocKind(callee->getName());
+                if (kind == AllocFree) {
+                    IRBuilder<> IRB(I);
+                    IRB.CreateCall(freeFunc, IRB.CreatePointerCast(CS.getArgument(0), i8Ptr));
+                    continue;
+                }
+
+                InvokeInst *invoke = dyn_cast<InvokeInst>(I);
+                BasicBlock *dest = invoke ? invoke->getNormalDest() : I->getParent();
+                IRBuilder<> IRB(dest, invoke ? dest->getFirstInsertionPt() : std::next(BasicBlock::iterator(I)));
+                Value *size;
+                if (kind == AllocCalloc) {
+                    size = IRB.CreateMul(IRB.CreateZExtOrTrunc(CS.getArgument(0), i64), IRB.CreateZExtOrTrunc(CS.getArgument(1), i64));
+                }
+                else {
+                    size = IRB.CreateZExtOrTrunc(CS.getArgument(kind == AllocRealloc ? 1 : 0), i64);
+                }
+                // the old block is gone only if realloc succeeded (or was asked
+                // for 0 bytes); a failed realloc leaves it live
+                if (kind == AllocRealloc) {
+                    Value *old = IRB.CreatePointerCast(CS.getArgument(0), i8Ptr);
+                    Value *kept = IRB.CreateAnd(IRB.CreateIsNull(I), IRB.CreateICmpNE(size, ConstantInt::get(i64, 0)));
+                    IRB.CreateCall(freeFunc, IRB.CreateSelect(kept, Constant::getNullValue(i8Ptr), old));
+                }
+                IRB.CreateCall(allocFunc, {ConstantInt::get(i32, allocSiteDescs.size()), IRB.CreatePointerCast(I, i8Ptr), size});
+
+                BasicBlock *BB = I->getParent();
+                auto loop = innermost.find(BB);
+                Constant *loopName = loop == innermost.end() ? Constant::getNullValue(i8Ptr) : createNameString(M, loop->second->getName(), "aLoop");
+                allocSiteDescs.push_back(ConstantStruct::get(allocSiteTy, {createNameString(M, F.getName(), "aFunc"), createNameString(M, BB->getName(), "aBlock"), createNameString(M, callee->getName(), "aCallee"), loopName}));
+                errs() << "Allocation site " << allocSiteDescs.size() - 1 << ": " << BB->getName() << ' ' << callee->getName() << '\n';
+            }
+        }
+
+        void registerAllocSites(Module &M) {
+            Type *voidTy = Type::getVoidTy(*Context);
+            Type *i32 = Type::getInt32Ty(*Context);
+            Function *initFunc = runtime_prototype(&M, "__cs201_alloc_init", FunctionType::get(voidTy, {allocSiteTy->getPointerTo(), i32, i32}, false));
+            Function *ctor = Function::Create(FunctionType::get(voidTy, false), GlobalValue::InternalLinkage, "cs201.alloc.ctor", &M);
+            IRBuilder<> IRB(BasicBlock::Create(*Context, "entry", ctor));
+            Constant *table = constantArray(&M, allocSiteTy, allocSiteDescs, "cs201.alloc.sites");
+            IRB.CreateCall(initFunc, {table, ConstantInt::get(i32, allocSiteDescs.size()), ConstantInt::get(i32, AllocTop)});
+            IRB.CreateRetVoid();
+            appendToGlobalCtors(M, ctor, 0);
+        }
+
+        // main only calls cs201.print; its body and the descriptor table are
+        // built in doFinalization, once every function has its counters
+        void addFinalPrintf(BasicBlock& BB) {
+            if (!profilePrintFunc) {
+                profilePrintFunc = Function::Create(FunctionType::get(Type::getVoidTy(*Context), false), GlobalValue::InternalLinkage, "cs201.print", BB.getParent()->getParent());
+            }
+            IRBuilder<> builder(BB.getTerminator()); // Insert BEFORE the final statement
+            CallInst *call = builder.CreateCall(profilePrintFunc);
+            call->setTailCall(false);
+        }
+
+        void addCoverageFixup(BasicBlock& BB) {
+            if (!coverageFixupFunc) {
+                coverageFixupFunc = Function::Create(FunctionType::get(Type::getVoidTy(*Context), false), GlobalValue::InternalLinkage, "cs201.coverage.fixup", BB.getParent()->getParent());
+            }
+            IRBuilder<> builder(BB.getTerminator());
+            CallInst *call = builder.CreateCall(coverageFixupFunc);
+            call->setTailCall(false);
+        }
+
+        unsigned blobString(std::string &blob, std::map<std::string, unsigned> &offsets, StringRef str) {
+            auto it = offsets.find(str.str());
+            if (it != offsets.end()) {
+                return it->second;
+            }
+            unsigned offset = blob.size();
+            blob += str;
+            blob.push_back('\0');
+            offsets[str.str()] = offset;
+            return offset;
+        }
+
+        void addDumpRow(std::vector<DumpRow> &rows, unsigned kind, StringRef funcN, StringRef name, GlobalVariable *counter, std::string &blob, std::map<std::string, unsigned> &offsets, bool withFunction) {
+            if (!counter) {
+                return;
+            }
+            int slot = ProfileCoverage != CoverageOff && kind < 2 ? (int)_COVERAGESLOTS[funcN][name].index : -1;
+            int function = withFunction ? (int)blobString(blob, offsets, funcN) : -1;
+            rows.push_back({kind, slot, function, (int)blobString(blob, offsets, name), counter});
+        }
+
+        // One descriptor per printed line, {kind, slot, function, name, counter}:
+        // kind 0/1/2/3 is block/edge/loop/cfg, a row without a name only prints the
+        // section title, slot is the coverage bitmap slot (-1 for i32 counters).
+        // All names share one string blob, so the dump is a fixed-size loop
+        // however many counters the module has. The same table drives the
+        // runtime's file output (-profile-file).
+        GlobalVariable* buildProfileTable(Module &M) {
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+            std::vector<DumpRow> rows;
+            std::string blob;
+            std::map<std::string, unsigned> offsets;
+
+            rows.push_back({0, -1, -1, -1, NULL});
             for (auto i = _BBCOUNTERS.begin(); i != _BBCOUNTERS.end(); ++i) {
                 for (auto it = i->second.begin(); it != i->second.end(); ++it) {
-                    Value *bbc = builder.CreateLoad(it->second);
-                    Constant *bbName = ConstantDataArray::getString(*Context, it->first);
-                    GlobalVariable *bname = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), it->first.size()+1), true, llvm::GlobalValue::PrivateLinkage, bbName, "bname");
-                    CallInst *call1 = builder.CreateCall(printf_func, {var_ref, bname, bbc});
-                    call1->setTailCall(false);
-                }
-            }
-
-            /****************************Edge Profiling*******************************/
-            const char* edgeProfile = "\nEDGE PROFILING:\n";
-            Constant *Estr = ConstantDataArray::getString(*Context, edgeProfile);
-            GlobalVariable *edgeTitle = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), strlen(edgeProfile)+1), true, llvm::GlobalValue::PrivateLinkage, Estr, "edgeTitle");
-            Constant *eProfile = ConstantExpr::getGetElementPtr(edgeTitle, indices);
-            CallInst *call2 = builder.CreateCall(printf_func, eProfile);
-            call2->setTailCall(false);
-
-            const char *edgePrintStr = "%s: %d\n";
-            Constant *eStr = ConstantDataArray::getString(*Context, edgePrintStr);
-            GlobalVariable *edgeFormatStr = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), strlen(edgePrintStr)+1), true, llvm::GlobalValue::PrivateLinkage, eStr, "edgeFormatStr");
-            Constant *edgePrint = ConstantExpr::getGetElementPtr(edgeFormatStr, indices);
+                    addDumpRow(rows, 0, i->first, it->first, it->second, blob, offsets, true);
+                }
+            }
+            rows.push_back({1, -1, -1, -1, NULL});
             for (auto i = _EDGECOUNTERS.begin(); i != _EDGECOUNTERS.end(); ++i) {
                 for (auto it = i->second.begin(); it != i->second.end(); ++it) {
-                    Value *edge = builder.CreateLoad(it->second);
-                    Constant *edgeName = ConstantDataArray::getString(*Context, it->first);
-                    GlobalVariable *eName = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), it->first.size()+1), true, llvm::GlobalValue::PrivateLinkage, edgeName, "eName");
-                    CallInst *call3 = builder.CreateCall(printf_func, {edgePrint, eName, edge});
-                    call3->setTailCall(false);
-                }
-            }
-
-            /********************************Loop Profiling****************************/
-            const char* loopProfile = "\nLOOP PROFILING:\n";
-            Constant *Lstr = ConstantDataArray::getString(*Context, loopProfile);
-            GlobalVariable *loopTitle = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), strlen(loopProfile)+1), true, llvm::GlobalValue::PrivateLinkage, Lstr, "loopTitle");
-            Constant *lProfile = ConstantExpr::getGetElementPtr(loopTitle, indices);
-            CallInst *call4 = builder.CreateCall(printf_func, lProfile);
-            call4->setTailCall(false);
-
-            const char *loopPrintStr = "%s: %d\n";
-            Constant *lStr = ConstantDataArray::getString(*Context, loopPrintStr);
-            GlobalVariable *loopFormatStr = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), strlen(loopPrintStr)+1), true, llvm::GlobalValue::PrivateLinkage, lStr, "edgeFormatStr");
-            Constant *loopPrint = ConstantExpr::getGetElementPtr(loopFormatStr, indices);
+                    addDumpRow(rows, 1, i->first, it->first, it->second, blob, offsets, true);
+                }
+            }
+            rows.push_back({2, -1, -1, -1, NULL});
             for (auto i = _LOOPS.begin(); i != _LOOPS.end(); ++i) {
                 for (auto it = i->second.begin(); it != i->second.end(); ++it) {
-                    if (!it->second.empty()) {
-                        for (unsigned i = 0; i < it->second.size(); ++i) {
-                            std::string loopStr;
-                            std::string backStr;
-                            for (unsigned j = 0; j < it->second.at(i).size(); ++j) {
-                                loopStr += it->second.at(i).at(j)->getName();
-                                if (j != it->second.at(i).size()-1) {
-                                    loopStr += " ";
-                                }
-                            }
-                            backStr = it->second.at(i).back()->getName().str() + " -> " + it->second.at(i).front()->getName().str();
-                            StringRef backedge = StringRef(backStr);
-                            StringRef loopN = StringRef(loopStr);
-                            StringRef funcN = it->second.at(i).back()->getParent()->getName();
-                            Value *loopCounter = builder.CreateLoad(_EDGECOUNTERS[funcN][backedge]);
-                            Constant *loopName = ConstantDataArray::getString(*Context, loopN);
-                            GlobalVariable *lName = new GlobalVariable(*BB.getParent()->getParent(), llvm::ArrayType::get(llvm::IntegerType::get(*Context, 8), loopN.size()+1), true, llvm::GlobalValue::PrivateLinkage, loopName, "lName");
-                            CallInst *call5 = builder.CreateCall(printf_func, {loopPrint, lName, loopCounter});
-                            call5->setTailCall(false);
+                    for (unsigned i = 0; i < it->second.size(); ++i) {
+                        std::string loopStr = loopName(it->second.at(i));
+                        std::string backStr = backEdgeName(it->second.at(i));
+                        StringRef funcN = it->second.at(i).back()->getParent()->getName();
+                        GlobalVariable *counter = _EDGECOUNTERS[funcN].count(backStr) ? _EDGECOUNTERS[funcN][backStr] : NULL;
+                        if (counter) {
+                            int slot = ProfileCoverage != CoverageOff ? (int)_COVERAGESLOTS[funcN][backStr].index : -1;
+                            rows.push_back({2, slot, -1, (int)blobString(blob, offsets, loopStr), counter});
                         }
                     }
                 }
             }
+            rows.push_back({3, -1, -1, -1, NULL});
+            for (auto i = _CFGROWS.begin(); i != _CFGROWS.end(); ++i) {
+                for (auto it = i->second.begin(); it != i->second.end(); ++it) {
+                    addDumpRow(rows, 3, i->first, it->first, it->second, blob, offsets, true);
+                }
+            }
+
+            Constant *zero = ConstantInt::get(i32, 0);
+            Constant *names = ConstantDataArray::getString(*Context, blob, false);
+            GlobalVariable *nameBlob = new GlobalVariable(M, names->getType(), true, GlobalValue::PrivateLinkage, names, "cs201.names");
+            Constant *nullStr = Constant::getNullValue(i8Ptr);
+            auto blobRef = [&](int offset) -> Constant* {
+                if (offset < 0) {
+                    return nullStr;
+                }
+                std::vector<Constant*> indices = {zero, ConstantInt::get(i32, offset)};
+                return ConstantExpr::getGetElementPtr(nameBlob, indices);
+            };
+            StructType *descTy = StructType::create(*Context, {i32, i32, i8Ptr, i8Ptr, i8Ptr}, "cs201.desc");
+            std::vector<Constant*> descs;
+            for (auto &row: rows) {
+                Constant *counter = row.counter ? ConstantExpr::getBitCast(row.counter, i8Ptr) : nullStr;
+                descs.push_back(ConstantStruct::get(descTy, {ConstantInt::get(i32, row.kind), ConstantInt::get(i32, row.slot, true), blobRef(row.function), blobRef(row.name), counter}));
+            }
+            ArrayType *tableTy = ArrayType::get(descTy, descs.size());
+            profileTableRows = rows.size();
+            profileNames = blob;
+            return new GlobalVariable(M, tableTy, true, GlobalValue::PrivateLinkage, ConstantArray::get(tableTy, descs), "cs201.table");
+        }
+
+        void buildProfilePrint(Module &M, GlobalVariable *table) {
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+            Constant *zero = ConstantInt::get(i32, 0);
+            Constant *nullStr = Constant::getNullValue(i8Ptr);
+
+            ArrayType *titlesTy = ArrayType::get(i8Ptr, 4);
+            Constant *titleStrs[] = {createNameString(&M, "BASIC BLOCK PROFILING:\n", "bbTitle"), createNameString(&M, "\nEDGE PROFILING:\n", "edgeTitle"), createNameString(&M, "\nLOOP PROFILING:\n", "loopTitle"), createNameString(&M, "\nCFG CHECKSUMS:\n", "cfgTitle")};
+            GlobalVariable *titles = new GlobalVariable(M, titlesTy, true, GlobalValue::PrivateLinkage, ConstantArray::get(titlesTy, titleStrs), "cs201.titles");
+            // "Function: name" heads each function's lines so the profile can be read back (ProfileData)
+            Constant *funcPrint = createNameString(&M, "Function: %s\n", "funcFormatStr");
+            std::vector<Constant*> indices = {zero, zero};
+            Constant *countPrint = ConstantExpr::getGetElementPtr(BasicBlockPrintfFormatStr, indices);
+
+            Function *F = profilePrintFunc;
+            BasicBlock *entry = BasicBlock::Create(*Context, "entry", F);
+            BasicBlock *loop = BasicBlock::Create(*Context, "row", F);
+            BasicBlock *title = BasicBlock::Create(*Context, "title", F);
+            BasicBlock *checkFunc = BasicBlock::Create(*Context, "checkFunc", F);
+            BasicBlock *funcHeader = BasicBlock::Create(*Context, "funcHeader", F);
+            BasicBlock *value = BasicBlock::Create(*Context, "value", F);
+            BasicBlock *latch = BasicBlock::Create(*Context, "next", F);
+            BasicBlock *exit = BasicBlock::Create(*Context, "exit", F);
+
+            IRBuilder<> IRB(entry);
+            IRB.CreateBr(loop);
+
+            IRB.SetInsertPoint(loop);
+            PHINode *i = IRB.CreatePHI(i32, 2, "i");
+            PHINode *prevFunc = IRB.CreatePHI(i8Ptr, 2, "prevFunc");
+            auto field = [&](unsigned k, const char *name) {
+                Value *idx[] = {zero, i, ConstantInt::get(i32, k)};
+                return IRB.CreateLoad(IRB.CreateGEP(table, idx), name);
+            };
+            Value *kind = field(0, "kind");
+            Value *slot = field(1, "slot");
+            Value *func = field(2, "func");
+            Value *name = field(3, "name");
+            Value *counter = field(4, "counter");
+            IRB.CreateCondBr(IRB.CreateICmpEQ(name, nullStr), title, checkFunc);
+
+            IRB.SetInsertPoint(title);
+            Value *titleIdx[] = {zero, kind};
+            IRB.CreateCall(printf_func, IRB.CreateLoad(IRB.CreateGEP(titles, titleIdx)));
+            IRB.CreateBr(latch);
+
+            IRB.SetInsertPoint(checkFunc);
+            Value *newFunc = IRB.CreateAnd(IRB.CreateICmpNE(func, nullStr), IRB.CreateICmpNE(func, prevFunc));
+            IRB.CreateCondBr(newFunc, funcHeader, value);
+
+            IRB.SetInsertPoint(funcHeader);
+            IRB.CreateCall(printf_func, {funcPrint, func});
+            IRB.CreateBr(value);
+
+            IRB.SetInsertPoint(value);
+            Value *count;
+            if (ProfileCoverage == CoverageOff) {
+                count = loadDumpCounter(IRB, counter, slot);
+            }
+            else {
+                // rows without a bitmap slot (the CFG checksums) are plain i32s
+                BasicBlock *plain = BasicBlock::Create(*Context, "plain", F, latch);
+                BasicBlock *bitmap = BasicBlock::Create(*Context, "bitmap", F, latch);
+                BasicBlock *print = BasicBlock::Create(*Context, "print", F, latch);
+                IRB.CreateCondBr(IRB.CreateICmpSLT(slot, zero), plain, bitmap);
+                IRB.SetInsertPoint(plain);
+                Value *plainCount = IRB.CreateLoad(IRB.CreateBitCast(counter, i32->getPointerTo()));
+                IRB.CreateBr(print);
+                IRB.SetInsertPoint(bitmap);
+                Value *bitmapCount = loadDumpCounter(IRB, counter, slot);
+                IRB.CreateBr(print);
+                IRB.SetInsertPoint(print);
+                PHINode *phi = IRB.CreatePHI(i32, 2, "count");
+                phi->addIncoming(plainCount, plain);
+                phi->addIncoming(bitmapCount, bitmap);
+                count = phi;
+            }
+            IRB.CreateCall(printf_func, {countPrint, name, count});
+            BasicBlock *printed = IRB.GetInsertBlock();
+            IRB.CreateBr(latch);
+
+            IRB.SetInsertPoint(latch);
+            PHINode *lastFunc = IRB.CreatePHI(i8Ptr, 2, "lastFunc");
+            lastFunc->addIncoming(nullStr, title);
+            lastFunc->addIncoming(func, printed);
+            Value *next = IRB.CreateAdd(i, ConstantInt::get(i32, 1));
+            IRB.CreateCondBr(IRB.CreateICmpEQ(next, ConstantInt::get(i32, profileTableRows)), exit, loop);
+            i->addIncoming(zero, entry);
+            i->addIncoming(next, latch);
+            prevFunc->addIncoming(nullStr, entry);
+            prevFunc->addIncoming(lastFunc, latch);
+
+            IRB.SetInsertPoint(exit);
+            IRB.CreateRetVoid();
+        }
+
+        // FNV-1a over the counter names; stable across runs, unlike hash_value
+        static uint64_t moduleHash(StringRef names) {
+            uint64_t hash = 14695981039346656037ULL;
+            for (char c: names) {
+                hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        // A constructor hands the table to the runtime, which resets the
+        // counters in forked children and writes the file from atexit.
+        void registerProfileFile(Module &M, GlobalVariable *table) {
+            Type *voidTy = Type::getVoidTy(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i64 = Type::getInt64Ty(*Context);
+            FunctionType *fixupTy = FunctionType::get(voidTy, false);
+            Function *initFunc = runtime_prototype(&M, "__cs201_profile_init", FunctionType::get(voidTy, {i8Ptr, i32, fixupTy->getPointerTo(), i8Ptr, i64, i32}, false));
+
+            Function *ctor = Function::Create(fixupTy, GlobalValue::InternalLinkage, "cs201.profile.ctor", &M);
+            IRBuilder<> IRB(BasicBlock::Create(*Context, "entry", ctor));
+            // flags: 1 = merge, 2 = coverage bitmaps hold bits rather than bytes
+            unsigned flags = (ProfileMerge ? 1 : 0) | (ProfileCoverage == CoverageBit ? 2 : 0);
+            Value *fixup = coverageFixupFunc ? (Value*)coverageFixupFunc : Constant::getNullValue(fixupTy->getPointerTo());
+            IRB.CreateCall(initFunc, {IRB.CreateBitCast(table, i8Ptr), ConstantInt::get(i32, profileTableRows), fixup, createNameString(&M, ProfileFile, "profileFile"), ConstantInt::get(i64, moduleHash(profileNames)), ConstantInt::get(i32, flags)});
+            IRB.CreateRetVoid();
+            appendToGlobalCtors(M, ctor, 0);
+        }
+
+        // i32 counter, or 0/1 read from a coverage bitmap slot
+        Value* loadDumpCounter(IRBuilder<> &IRB, Value *counter, Value *slot) {
+            Type *i32 = Type::getInt32Ty(*Context);
+            if (ProfileCoverage == CoverageOff) {
+                return IRB.CreateLoad(IRB.CreateBitCast(counter, i32->getPointerTo()));
+            }
+            if (ProfileCoverage == CoverageByte) {
+                return IRB.CreateZExt(IRB.CreateLoad(IRB.CreateGEP(counter, slot)), i32);
+            }
+            Value *bits = IRB.CreateLoad(IRB.CreateGEP(counter, IRB.CreateLShr(slot, 3)));
+            Value *shift = IRB.CreateTrunc(IRB.CreateAnd(slot, 7), Type::getInt8Ty(*Context));
+            return IRB.CreateZExt(IRB.CreateAnd(IRB.CreateLShr(bits, shift), 1), i32);
+        }
+
+        // Pruned coverage probes: copy the coverage implied by their neighbours
+        // into their own slots, from a {map, slot, dep} table, before anything
+        // reads or saves the bitmaps.
+        void buildCoverageFixup(Module &M) {
+            Type *i8 = Type::getInt8Ty(*Context);
+            Type *i32 = Type::getInt32Ty(*Context);
+            Type *i8Ptr = Type::getInt8PtrTy(*Context);
+            StructType *fixTy = StructType::create(*Context, {i8Ptr, i32, i32}, "cs201.implied");
+            std::vector<Constant*> fixes;
+            for (auto i = _COVERAGESLOTS.begin(); i != _COVERAGESLOTS.end(); ++i) {
+                Constant *map = ConstantExpr::getBitCast(_COVERAGEMAPS[i->first], i8Ptr);
+                for (auto it = i->second.begin(); it != i->second.end(); ++it) {
+                    for (unsigned dep: it->second.implied) {
+                        fixes.push_back(ConstantStruct::get(fixTy, {map, ConstantInt::get(i32, it->second.index), ConstantInt::get(i32, dep)}));
+                    }
+                }
+            }
+
+            Function *F = coverageFixupFunc;
+            BasicBlock *entry = BasicBlock::Create(*Context, "entry", F);
+            IRBuilder<> IRB(entry);
+            if (fixes.empty()) {
+                IRB.CreateRetVoid();
+                return;
+            }
+            ArrayType *tableTy = ArrayType::get(fixTy, fixes.size());
+            GlobalVariable *table = new GlobalVariable(M, tableTy, true, GlobalValue::PrivateLinkage, ConstantArray::get(tableTy, fixes), "cs201.implied.table");
+            BasicBlock *loop = BasicBlock::Create(*Context, "fix", F);
+            BasicBlock *exit = BasicBlock::Create(*Context, "exit", F);
+            IRB.CreateBr(loop);
+
+            IRB.SetInsertPoint(loop);
+            Constant *zero = ConstantInt::get(i32, 0);
+            PHINode *i = IRB.CreatePHI(i32, 2, "i");
+            auto field = [&](unsigned k) {
+                Value *idx[] = {zero, i, ConstantInt::get(i32, k)};
+                return IRB.CreateLoad(IRB.CreateGEP(table, idx));
+            };
+            Value *map = field(0);
+            Value *slot = field(1);
+            Value *dep = field(2);
+            Value *covered = IRB.CreateTrunc(loadDumpCounter(IRB, map, dep), i8);
+            Value *byte = ProfileCoverage == CoverageBit ? IRB.CreateLShr(slot, 3) : slot;
+            Value *addr = IRB.CreateGEP(map, byte);
+            if (ProfileCoverage == CoverageBit) {
+                covered = IRB.CreateShl(covered, IRB.CreateTrunc(IRB.CreateAnd(slot, 7), i8));
+            }
+            IRB.CreateStore(IRB.CreateOr(IRB.CreateLoad(addr), covered), addr);
+            Value *next = IRB.CreateAdd(i, ConstantInt::get(i32, 1));
+            IRB.CreateCondBr(IRB.CreateICmpEQ(next, ConstantInt::get(i32, fixes.size())), exit, loop);
+            i->addIncoming(zero, entry);
+            i->addIncoming(next, loop);
+
+            IRB.SetInsertPoint(exit);
+            IRB.CreateRetVoid();
+        }
+
+        // Hands every function's bitmap to the runtime. main only calls it;
+        // the body is built here so functions after main are included too.
+        void buildCoverageRegister(Module &M) {
+            IRBuilder<> IRB(BasicBlock::Create(*Context, "entry", coverageRegisterFunc));
+            Constant *zero = Constant::getNullValue(IntegerType::getInt32Ty(*Context));
+            std::vector<Constant*> indices = {zero, zero};
+            for (auto i = _COVERAGEMAPS.begin(); i != _COVERAGEMAPS.end(); ++i) {
+                unsigned bytes = cast<ArrayType>(i->second->getType()->getElementType())->getNumElements();
+                Constant *map = ConstantExpr::getGetElementPtr(i->second, indices);
+                IRB.CreateCall(coverageAddFunc, {createNameString(&M, i->first, "cName"), map, ConstantInt::get(Type::getInt32Ty(*Context), bytes)});
+            }
+            IRB.CreateRetVoid();
+        }
+
+        // the runtime/ dumps still run with -profile-dump=false
+        void addRuntimeDumps(BasicBlock &BB) {
+            IRBuilder<> builder(BB.getTerminator());
+
+            /*******************************Timing Profiling***************************/
+            if (ProfileTiming) {
+                CallInst *call6 = builder.CreateCall(timingDumpFunc);
+                call6->setTailCall(false);
+            }
+
+            /******************************Coverage Bitmaps****************************/
+            if (ProfileCoverage != CoverageOff) {
+                if (!coverageRegisterFunc) {
+                    coverageRegisterFunc = Function::Create(FunctionType::get(Type::getVoidTy(*Context), false), GlobalValue::InternalLinkage, "cs201.coverage.register", BB.getParent()->getParent());
+                }
+                builder.CreateCall(coverageRegisterFunc)->setTailCall(false);
+                CallInst *call7 = builder.CreateCall(coverageDumpFunc);
+                call7->setTailCall(false);
+            }
+
+            /******************************Loop Path Traces****************************/
+            if (LoopPaths) {
+                CallInst *call8 = builder.CreateCall(loopPathDumpFunc);
+                call8->setTailCall(false);
+            }
+
+            /******************************Allocation Sites****************************/
+            if (ProfileAlloc) {
+                CallInst *call9 = builder.CreateCall(allocDumpFunc);
+                call9->setTailCall(false);
+            }
         }
     };
 }
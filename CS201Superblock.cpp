@@ -0,0 +1,334 @@
+// Profile-driven superblock formation.
+//
+//   opt -load CS201Profiling.so -cs201-superblock -cs201-profile-use=prog.profile prog.bc
+//
+// prog.profile is the output of the program instrumented by -pathProfiling
+// from the same prog.bc (see ProfileData.h). Traces are grown from the
+// hottest blocks that are not yet on a trace, forward along the successor
+// edge that is both the likely way out of the current block and the likely
+// way into the next one (Hwu et al., "The Superblock: An Effective Technique
+// for VLIW and Superscalar Compilation"). A trace stops at a back edge, a
+// landing pad, a block whose address is taken or one already on a trace.
+//
+// The part of a trace from its first side entrance on is then duplicated:
+// every side entrance goes to the copy, so the trace is entered only at its
+// head and later passes can schedule and simplify across it. The trace is
+// laid out as one fall-through run. Duplication per function is limited to
+// -cs201-superblock-growth percent of its instructions; a trace whose tail
+// does not fit is shortened until it does.
+#include "ProfileData.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <string>
+
+using namespace llvm;
+using namespace cs201;
+
+static cl::opt<unsigned> SuperblockGrowth("cs201-superblock-growth", cl::init(50),
+    cl::desc("Instructions -cs201-superblock may duplicate, in percent of the function's size"));
+
+static cl::opt<unsigned> SuperblockMinProb("cs201-superblock-min-prob", cl::init(60),
+    cl::desc("Percent of a block's count an edge needs to extend a trace, at both of its ends"));
+
+namespace {
+    struct CS201Superblock : public ModulePass {
+        static char ID;
+        CS201Superblock() : ModulePass(ID) {}
+        ProfileData profile;
+        std::vector<BasicBlock*> blocks;
+        std::vector<uint64_t> counts;
+        std::map<std::pair<unsigned, unsigned>, uint64_t> edges;
+        unsigned totalTraces = 0;
+        unsigned totalDuplicated = 0;
+
+        //----------------------------------
+        bool runOnModule(Module &M) override {
+            std::string error;
+            if (ProfileUse.empty() || !profile.read(ProfileUse, error)) {
+                errs() << "cs201-superblock: no profile (" << (ProfileUse.empty() ? "use -cs201-profile-use" : error) << ")\n";
+                return false;
+            }
+            bool changed = false;
+            for (auto &F: M) {
+                if (!F.isDeclaration()) {
+                    changed |= runOnFunction(F);
+                }
+            }
+            errs() << "Superblocks: " << totalTraces << " traces, " << totalDuplicated << " instructions duplicated\n";
+            return changed;
+        }
+
+        bool runOnFunction(Function &F) {
+            ProfileData::Match match;
+            const FunctionProfile *fp = profile.getMatched(F, &match);
+            if (!fp || (match == ProfileData::Unchecked && fp->blocks.size() != F.size()) || fp->entryCount() == 0) {
+                return false;
+            }
+
+            blocks.clear();
+            counts.clear();
+            unsigned size = 0;
+            for (auto &BB: F) {
+                auto count = fp->blocks.find(blocks.size());
+                counts.push_back(count == fp->blocks.end() ? 0 : count->second);
+                blocks.push_back(&BB);
+                size += BB.size();
+            }
+            edges = fp->edges;
+
+            std::vector<std::vector<BasicBlock*>> traces = selectTraces(F);
+            uint64_t budget = (uint64_t)size * SuperblockGrowth / 100;
+            bool changed = false;
+            for (auto &trace: traces) {
+                unsigned duplicated = formSuperblock(trace, budget);
+                if (trace.size() < 2) {
+                    continue;
+                }
+                errs() << "Function: " << F.getName() << " superblock";
+                for (BasicBlock *BB: trace) {
+                    errs() << ' ' << BB->getName();
+                }
+                errs() << " (" << duplicated << " instructions duplicated)\n";
+                totalDuplicated += duplicated;
+                ++totalTraces;
+                changed = true;
+            }
+            return changed;
+        }
+
+        unsigned indexOf(BasicBlock *BB) {
+            return std::find(blocks.begin(), blocks.end(), BB) - blocks.begin();
+        }
+
+        uint64_t edgeCount(unsigned from, unsigned to) {
+            auto it = edges.find(std::make_pair(from, to));
+            return it == edges.end() ? 0 : it->second;
+        }
+
+        bool eligible(BasicBlock *BB) {
+            if (BB->isLandingPad() || BB->hasAddressTaken()) {
+                return false;
+            }
+            for (auto &I: *BB) {
+                // noduplicate holds for invokes as much as for calls
+                CallSite CS(&I);
+                if (CS && CS.cannotDuplicate()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Hottest unclaimed block first; each trace is extended while the
+        // heaviest edge out of its last block carries at least MinProb of
+        // both ends' counts. Only traces of two or more blocks are kept.
+        std::vector<std::vector<BasicBlock*>> selectTraces(Function &F) {
+            DominatorTree DT(F);
+            std::vector<unsigned> order;
+            for (unsigned b = 0; b < blocks.size(); ++b) {
+                order.push_back(b);
+            }
+            std::stable_sort(order.begin(), order.end(), [this](unsigned a, unsigned b) { return counts.at(a) > counts.at(b); });
+
+            std::vector<bool> claimed(blocks.size(), false);
+            std::vector<std::vector<BasicBlock*>> traces;
+            for (unsigned seed: order) {
+                if (claimed.at(seed) || counts.at(seed) == 0 || !eligible(blocks.at(seed))) {
+                    continue;
+                }
+                std::vector<BasicBlock*> trace(1, blocks.at(seed));
+                claimed.at(seed) = true;
+                unsigned cur = seed;
+                while (true) {
+                    unsigned best = blocks.size();
+                    uint64_t weight = 0;
+                    for (auto it = succ_begin(blocks.at(cur)), et = succ_end(blocks.at(cur)); it != et; ++it) {
+                        unsigned s = indexOf(*it);
+                        if (edgeCount(cur, s) > weight) {
+                            best = s;
+                            weight = edgeCount(cur, s);
+                        }
+                    }
+                    if (best == blocks.size() || best == 0 || claimed.at(best) || !eligible(blocks.at(best))) {
+                        break;
+                    }
+                    if (weight * 100 < counts.at(cur) * SuperblockMinProb || weight * 100 < counts.at(best) * SuperblockMinProb) {
+                        break;
+                    }
+                    // a back edge would make the trace loop into itself
+                    if (DT.dominates(blocks.at(best), blocks.at(cur))) {
+                        break;
+                    }
+                    trace.push_back(blocks.at(best));
+                    claimed.at(best) = true;
+                    cur = best;
+                }
+                if (trace.size() > 1) {
+                    traces.push_back(trace);
+                }
+            }
+            return traces;
+        }
+
+        // Duplicates the trace from its first side entrance on, then lays
+        // the trace out in order. Returns the instructions duplicated.
+        unsigned formSuperblock(std::vector<BasicBlock*> &trace, uint64_t &budget) {
+            unsigned first = trace.size();
+            for (unsigned j = 1; j < trace.size() && first == trace.size(); ++j) {
+                for (auto it = pred_begin(trace.at(j)), et = pred_end(trace.at(j)); it != et; ++it) {
+                    if (*it != trace.at(j-1)) {
+                        first = j;
+                        break;
+                    }
+                }
+            }
+            // the copy of a block with an edge back into the tail would need
+            // that edge split between the copies; keep the tail straight
+            for (unsigned j = first; j < trace.size(); ++j) {
+                for (auto it = succ_begin(trace.at(j)), et = succ_end(trace.at(j)); it != et; ++it) {
+                    auto pos = std::find(trace.begin() + first, trace.end(), *it);
+                    if (pos != trace.end() && (j + 1 == trace.size() || *pos != trace.at(j+1))) {
+                        trace.resize(std::max(j, first));
+                        break;
+                    }
+                }
+            }
+            uint64_t cost = 0;
+            for (unsigned j = first; j < trace.size(); ++j) {
+                cost += trace.at(j)->size();
+            }
+            while (trace.size() > first && cost > budget) {
+                cost -= trace.back()->size();
+                trace.pop_back();
+            }
+
+            if (trace.size() > first) {
+                duplicateTail(trace, first);
+                budget -= cost;
+            }
+            for (unsigned j = 1; j < trace.size(); ++j) {
+                trace.at(j)->moveAfter(trace.at(j-1));
+            }
+            return cost;
+        }
+
+        void duplicateTail(std::vector<BasicBlock*> &trace, unsigned first) {
+            Function *F = trace.front()->getParent();
+            ValueToValueMapTy VMap;
+            std::vector<BasicBlock*> tail(trace.begin() + first, trace.end());
+            std::vector<BasicBlock*> copies;
+            for (BasicBlock *BB: tail) {
+                BasicBlock *copy = CloneBasicBlock(BB, VMap, ".sb", F);
+                VMap[BB] = copy;
+                copies.push_back(copy);
+            }
+            for (BasicBlock *copy: copies) {
+                for (auto &I: *copy) {
+                    RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingEntries);
+                }
+            }
+
+            // the side entrances move to the copies; each original keeps only
+            // the edge from the trace block before it
+            for (unsigned j = 0; j < tail.size(); ++j) {
+                BasicBlock *BB = tail.at(j);
+                BasicBlock *onTrace = trace.at(first + j - 1);
+                std::set<BasicBlock*> side;
+                for (auto it = pred_begin(BB), et = pred_end(BB); it != et; ++it) {
+                    if (*it != onTrace && std::find(copies.begin(), copies.end(), *it) == copies.end()) {
+                        side.insert(*it);
+                    }
+                }
+                for (BasicBlock *pred: side) {
+                    pred->getTerminator()->replaceUsesOfWith(BB, copies.at(j));
+                }
+                for (auto it = BB->begin(); PHINode *PN = dyn_cast<PHINode>(&*it); ++it) {
+                    for (unsigned k = PN->getNumIncomingValues(); k-- > 0; ) {
+                        if (PN->getIncomingBlock(k) != onTrace) {
+                            PN->removeIncomingValue(k, false);
+                        }
+                    }
+                }
+                // only the first copy still lists the trace; later copies
+                // were remapped to the copy before them
+                if (j == 0) {
+                    for (auto it = copies.at(j)->begin(); PHINode *PN = dyn_cast<PHINode>(&*it); ++it) {
+                        for (unsigned k = PN->getNumIncomingValues(); k-- > 0; ) {
+                            if (PN->getIncomingBlock(k) == onTrace) {
+                                PN->removeIncomingValue(k, false);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // the blocks the tail exits to are now also entered from the copies
+            for (unsigned j = 0; j < tail.size(); ++j) {
+                std::set<BasicBlock*> exits;
+                for (auto it = succ_begin(tail.at(j)), et = succ_end(tail.at(j)); it != et; ++it) {
+                    if (std::find(tail.begin(), tail.end(), *it) == tail.end()) {
+                        exits.insert(*it);
+                    }
+                }
+                for (BasicBlock *exit: exits) {
+                    for (auto it = exit->begin(); PHINode *PN = dyn_cast<PHINode>(&*it); ++it) {
+                        for (unsigned k = 0, e = PN->getNumIncomingValues(); k != e; ++k) {
+                            if (PN->getIncomingBlock(k) != tail.at(j)) {
+                                continue;
+                            }
+                            Value *V = PN->getIncomingValue(k);
+                            auto mapped = VMap.find(V);
+                            PN->addIncoming(mapped != VMap.end() ? (Value*)mapped->second : V, copies.at(j));
+                        }
+                    }
+                }
+            }
+
+            // every value of the tail now has two definitions; uses beyond
+            // its own block get a PHI where the two paths meet
+            for (unsigned j = 0; j < tail.size(); ++j) {
+                for (auto &I: *tail.at(j)) {
+                    if (I.use_empty()) {
+                        continue;
+                    }
+                    SSAUpdater SSA;
+                    SSA.Initialize(I.getType(), I.getName());
+                    SSA.AddAvailableValue(tail.at(j), &I);
+                    SSA.AddAvailableValue(copies.at(j), VMap[&I]);
+                    std::vector<Use*> uses;
+                    for (Use &U: I.uses()) {
+                        Instruction *user = cast<Instruction>(U.getUser());
+                        BasicBlock *userBB = user->getParent();
+                        if (PHINode *PN = dyn_cast<PHINode>(user)) {
+                            userBB = PN->getIncomingBlock(U);
+                        }
+                        if (userBB != tail.at(j)) {
+                            uses.push_back(&U);
+                        }
+                    }
+                    for (Use *U: uses) {
+                        SSA.RewriteUse(*U);
+                    }
+                }
+            }
+        }
+    };
+}
+
+char CS201Superblock::ID = 0;
+static RegisterPass<CS201Superblock> X("cs201-superblock", "CS201 profile-driven superblock formation", false, false);
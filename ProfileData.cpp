@@ -0,0 +1,272 @@
+#include "ProfileData.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstring>
+#include <vector>
+
+using namespace llvm;
+using namespace cs201;
+
+cl::opt<std::string> ProfileUse("cs201-profile-use",
+    cl::desc("Profile printed by a -pathProfiling run of the same bitcode"),
+    cl::value_desc("filename"));
+
+namespace {
+    struct Hash {
+        uint64_t value = 14695981039346656037ULL;
+        void mix(uint64_t v) {
+            for (int i = 0; i < 8; ++i, v >>= 8) {
+                value = (value ^ (v & 0xff)) * 1099511628211ULL;
+            }
+        }
+        void mix(StringRef text) {
+            for (char c: text) {
+                value = (value ^ (unsigned char)c) * 1099511628211ULL;
+            }
+        }
+        uint32_t get() const {
+            return (uint32_t)(value ^ (value >> 32)) & 0x7fffffff;
+        }
+    };
+}
+
+uint32_t cs201::blockAnchor(const BasicBlock &BB) {
+    Hash hash;
+    for (const Instruction &I: BB) {
+        hash.mix(I.getOpcode());
+        ImmutableCallSite CS(&I);
+        if (CS && CS.getCalledFunction()) {
+            hash.mix(CS.getCalledFunction()->getName());
+        }
+    }
+    return hash.get();
+}
+
+uint32_t cs201::cfgChecksum(const Function &F) {
+    std::map<const BasicBlock*, unsigned> index;
+    for (const BasicBlock &BB: F) {
+        unsigned n = index.size();
+        index[&BB] = n;
+    }
+    Hash hash;
+    hash.mix(F.size());
+    for (const BasicBlock &BB: F) {
+        hash.mix(blockAnchor(BB));
+        for (auto it = succ_begin(&BB), et = succ_end(&BB); it != et; ++it) {
+            hash.mix(index[*it]);
+        }
+    }
+    return hash.get();
+}
+
+bool ProfileData::parseBlockName(StringRef name, unsigned &bnum) {
+    name = name.trim();
+    if (!name.startswith("b")) {
+        return false;
+    }
+    return !name.substr(1).getAsInteger(10, bnum);
+}
+
+bool ProfileData::read(StringRef path, std::string &error) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+    if (std::error_code ec = buffer.getError()) {
+        error = path.str() + ": " + ec.message();
+        return false;
+    }
+
+    enum { None, Blocks, Edges, Checksums } section = None;
+    FunctionProfile *current = NULL;
+    for (line_iterator line(*buffer.get()); !line.is_at_eof(); ++line) {
+        StringRef text = line->trim();
+        // the program's own output and the other sections are skipped
+        if (text.find("PROFILING") != StringRef::npos || text == "CFG CHECKSUMS:") {
+            section = text.startswith("BASIC BLOCK PROFILING") ? Blocks : text.startswith("EDGE PROFILING") ? Edges : text.startswith("CFG") ? Checksums : None;
+            current = NULL;
+            continue;
+        }
+        if (section == None) {
+            continue;
+        }
+        if (text.startswith("Function: ")) {
+            current = &functions[text.substr(strlen("Function: ")).str()];
+            continue;
+        }
+        size_t colon = text.rfind(':');
+        if (!current || colon == StringRef::npos) {
+            continue;
+        }
+        long long count;
+        if (text.substr(colon+1).trim().getAsInteger(10, count)) {
+            continue;
+        }
+        // the counters are printed as %d
+        uint64_t value = count < 0 ? (uint64_t)(uint32_t)count : (uint64_t)count;
+        StringRef name = text.substr(0, colon);
+        if (section == Blocks) {
+            unsigned bnum;
+            if (parseBlockName(name, bnum)) {
+                current->blocks[bnum] = value;
+            }
+        }
+        else if (section == Checksums) {
+            unsigned bnum;
+            if (name == "checksum") {
+                current->hasChecksum = true;
+                current->checksum = value;
+            }
+            else if (parseBlockName(name, bnum)) {
+                current->anchors[bnum] = value;
+            }
+        }
+        else {
+            std::pair<StringRef, StringRef> ends = name.split(" -> ");
+            unsigned from, to;
+            if (parseBlockName(ends.first, from) && parseBlockName(ends.second, to)) {
+                current->edges[std::make_pair(from, to)] = value;
+            }
+        }
+    }
+    return true;
+}
+
+const FunctionProfile *ProfileData::getFunction(StringRef name) const {
+    auto it = functions.find(name.str());
+    return it == functions.end() ? NULL : &it->second;
+}
+
+// Old blocks are matched to F's by the longest common subsequence of their
+// anchors, in block order; the entry blocks always match. Counts follow the
+// matched blocks, and an edge count follows when both ends matched and F
+// still has that edge.
+static unsigned remap(const Function &F, const FunctionProfile &old, FunctionProfile &out) {
+    std::vector<const BasicBlock*> blocks;
+    std::vector<uint32_t> now;
+    for (const BasicBlock &BB: F) {
+        blocks.push_back(&BB);
+        now.push_back(blockAnchor(BB));
+    }
+    std::vector<unsigned> oldBlocks;
+    std::vector<uint32_t> before;
+    for (auto it = old.anchors.begin(); it != old.anchors.end(); ++it) {
+        oldBlocks.push_back(it->first);
+        before.push_back(it->second);
+    }
+
+    std::map<unsigned, unsigned> oldToNew;
+    size_t n = now.size(), m = before.size();
+    // the table is n*m; past a few million cells fall back to anchors that
+    // are unique on both sides
+    if (n * m <= (1u << 22)) {
+        std::vector<unsigned> lcs((n + 1) * (m + 1), 0);
+        for (size_t i = n; i-- > 0; ) {
+            for (size_t j = m; j-- > 0; ) {
+                lcs[i * (m + 1) + j] = now[i] == before[j] ? lcs[(i + 1) * (m + 1) + j + 1] + 1 : std::max(lcs[(i + 1) * (m + 1) + j], lcs[i * (m + 1) + j + 1]);
+            }
+        }
+        for (size_t i = 0, j = 0; i < n && j < m; ) {
+            if (now[i] == before[j]) {
+                oldToNew[oldBlocks[j++]] = i++;
+            }
+            else if (lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1]) {
+                ++i;
+            }
+            else {
+                ++j;
+            }
+        }
+    }
+    else {
+        std::map<uint32_t, int> seenNow, seenBefore;
+        std::map<uint32_t, unsigned> where;
+        for (size_t i = 0; i < n; ++i) {
+            seenNow[now[i]]++;
+            where[now[i]] = i;
+        }
+        for (uint32_t a: before) {
+            seenBefore[a]++;
+        }
+        for (size_t j = 0; j < m; ++j) {
+            if (seenNow[before[j]] == 1 && seenBefore[before[j]] == 1) {
+                oldToNew[oldBlocks[j]] = where[before[j]];
+            }
+        }
+    }
+    for (auto it = oldToNew.begin(); it != oldToNew.end(); ) {
+        if (it->first == 0 || it->second == 0) {
+            it = oldToNew.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    oldToNew[0] = 0;
+
+    for (auto it = oldToNew.begin(); it != oldToNew.end(); ++it) {
+        auto count = old.blocks.find(it->first);
+        if (count != old.blocks.end()) {
+            out.blocks[it->second] = count->second;
+        }
+    }
+    for (auto it = old.edges.begin(); it != old.edges.end(); ++it) {
+        auto from = oldToNew.find(it->first.first);
+        auto to = oldToNew.find(it->first.second);
+        if (from == oldToNew.end() || to == oldToNew.end()) {
+            continue;
+        }
+        const BasicBlock *src = blocks.at(from->second);
+        for (auto succ = succ_begin(src), et = succ_end(src); succ != et; ++succ) {
+            if (*succ == blocks.at(to->second)) {
+                out.edges[std::make_pair(from->second, to->second)] = it->second;
+                break;
+            }
+        }
+    }
+    out.hasChecksum = true;
+    out.checksum = cfgChecksum(F);
+    for (size_t i = 0; i < n; ++i) {
+        out.anchors[i] = now[i];
+    }
+    return oldToNew.size();
+}
+
+const FunctionProfile *ProfileData::getMatched(const Function &F, Match *match) {
+    Match dummy;
+    Match &result = match ? *match : dummy;
+    const FunctionProfile *fp = getFunction(F.getName());
+    if (!fp) {
+        result = NoProfile;
+        return NULL;
+    }
+    if (!fp->hasChecksum) {
+        result = Unchecked;
+        return fp;
+    }
+    if (fp->checksum == cfgChecksum(F)) {
+        result = Exact;
+        return fp;
+    }
+    if (stale.count(F.getName().str())) {
+        result = Stale;
+        return NULL;
+    }
+    auto done = remapped.find(F.getName().str());
+    if (done == remapped.end()) {
+        FunctionProfile out;
+        unsigned matched = remap(F, *fp, out);
+        // fewer than half of the blocks found again: not worth the risk
+        if (2 * matched < F.size()) {
+            errs() << "Function: " << F.getName() << " profile is stale (" << matched << " of " << F.size() << " blocks matched), ignored\n";
+            stale.insert(F.getName().str());
+            result = Stale;
+            return NULL;
+        }
+        errs() << "Function: " << F.getName() << " CFG changed, " << matched << " of " << F.size() << " blocks matched by anchors\n";
+        done = remapped.insert(std::make_pair(F.getName().str(), out)).first;
+    }
+    result = Remapped;
+    return &done->second;
+}
@@ -0,0 +1,95 @@
+//===- ProfileData.h - Read back the CS201Profiling dump ------------------===//
+//
+// The instrumented program prints its counters from main's return block:
+//
+//   BASIC BLOCK PROFILING:
+//   Function: main
+//   b0: 1
+//   EDGE PROFILING:
+//   Function: main
+//   b0 -> b1: 1
+//
+//   CFG CHECKSUMS:
+//   Function: main
+//   b0: 1402217715
+//   checksum: 90521133
+//
+// Save that output to a file and the feedback passes (-cs201-layout, ...)
+// read it back with ProfileData. Blocks are named bN by their position in the
+// function, exactly as runOnFunction names them. The checksum tells whether a
+// function's CFG is still the one that was profiled; when it is not, the
+// per-block anchors map the old counts onto the new blocks (getMatched).
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CS201_PROFILEDATA_H
+#define CS201_PROFILEDATA_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+// -cs201-profile-use, shared by every pass that consumes a profile
+extern llvm::cl::opt<std::string> ProfileUse;
+
+namespace llvm {
+class BasicBlock;
+class Function;
+}
+
+namespace cs201 {
+
+// A hash of the block count, the successor lists and every block's anchor,
+// and per block a hash of its opcodes and callees. Both are kept to 31 bits
+// so the dump prints them like counts.
+uint32_t cfgChecksum(const llvm::Function &F);
+uint32_t blockAnchor(const llvm::BasicBlock &BB);
+
+struct FunctionProfile {
+    std::map<unsigned, uint64_t> blocks;
+    std::map<std::pair<unsigned, unsigned>, uint64_t> edges;
+    // profiles written before the CFG CHECKSUMS section have neither
+    bool hasChecksum = false;
+    uint32_t checksum = 0;
+    std::map<unsigned, uint32_t> anchors;
+
+    uint64_t entryCount() const {
+        auto it = blocks.find(0);
+        return it == blocks.end() ? 0 : it->second;
+    }
+};
+
+class ProfileData {
+public:
+    enum Match {
+        NoProfile, // F did not run or is not in the file
+        Unchecked, // the file has no checksum for F
+        Exact,     // the checksum matches
+        Remapped,  // the CFG changed, counts moved over by anchors
+        Stale      // the CFG changed too much to trust the counts
+    };
+
+    // false (and a message in error) if the file cannot be read
+    bool read(llvm::StringRef path, std::string &error);
+    const FunctionProfile *getFunction(llvm::StringRef name) const;
+    // F's profile checked against F itself; NULL for NoProfile and Stale
+    const FunctionProfile *getMatched(const llvm::Function &F, Match *match = NULL);
+    const std::map<std::string, FunctionProfile> &getFunctions() const { return functions; }
+
+    // "b12" -> 12
+    static bool parseBlockName(llvm::StringRef name, unsigned &bnum);
+
+private:
+    std::map<std::string, FunctionProfile> functions;
+    // getMatched's results for changed CFGs, so each is remapped once
+    std::map<std::string, FunctionProfile> remapped;
+    std::set<std::string> stale;
+};
+
+}
+
+#endif
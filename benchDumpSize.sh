@@ -0,0 +1,44 @@
+# Code size and compile time of the profile dump, old against new, on
+# generated CFGs (tools/cs201-gen). The old dump put a load, a name global and
+# a printf per counter into main; the table-driven cs201.print is one loop.
+# Build the old plugin from the commit before the table dump, next to this one:
+#   git worktree add ../CS201Profiling.old "$(git log --format=%H --grep='^\[user-031\]' | tail -1)^"
+#   make -C ../CS201Profiling.old LIBRARYNAME=CS201ProfilingOld
+# then BEFORE_PLUGIN=../../../Release+Asserts/lib/CS201ProfilingOld.so ./benchDumpSize.sh
+# Prints CSV: pass_seconds is -pathProfiling's wall time from -time-passes,
+# llc_seconds the time to compile the instrumented module, text/data its
+# sections from llvm-size.
+SHAPES=${SHAPES:-"chain switch loops mesh functions"}
+SIZES=${SIZES:-"10 100 1000 10000"}
+PROFILE_FLAGS=${PROFILE_FLAGS}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+AFTER_PLUGIN=${AFTER_PLUGIN:-../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}}
+if [ -z "${BEFORE_PLUGIN}" ]; then
+    echo "set BEFORE_PLUGIN to a CS201Profiling library built before the table dump" >&2
+    exit 1
+fi
+OUT=$(mktemp -d)
+
+echo "shape,size,dump,pass_seconds,llc_seconds,text,data"
+for SHAPE in ${SHAPES}; do
+    for SIZE in ${SIZES}; do
+        ${BIN}/cs201-gen -shape=${SHAPE} -size=${SIZE} -o ${OUT}/gen.bc || exit 1
+        for DUMP in before after; do
+            if [ ${DUMP} == before ]; then PLUGIN=${BEFORE_PLUGIN}; else PLUGIN=${AFTER_PLUGIN}; fi
+            # -time-passes reports on stderr, after the pass's own block log;
+            # strip the "( 12.3%)" columns so wall time is third from the end
+            ${BIN}/opt -load ${PLUGIN} -pathProfiling ${PROFILE_FLAGS} -time-passes ${OUT}/gen.bc -o ${OUT}/prof.bc 2> ${OUT}/passes.txt || exit 1
+            PASS=$(grep 'CS201Profiling Pass' ${OUT}/passes.txt | sed 's/([^)]*)//g' | awk '{ print $(NF-2) }')
+            /usr/bin/time -f "%e" -o ${OUT}/time.txt ${BIN}/llc -O0 -filetype=obj ${OUT}/prof.bc -o ${OUT}/prof.o || exit 1
+            SIZE_TD=$(${BIN}/llvm-size ${OUT}/prof.o | awk 'NR == 2 { print $1 "," $2 }')
+            echo "${SHAPE},${SIZE},${DUMP},${PASS},$(cat ${OUT}/time.txt),${SIZE_TD}"
+        done
+    done
+done
+rm -rf ${OUT}
@@ -0,0 +1,25 @@
+
+# Profile support/${INPUT}.c, lay it out with -cs201-layout and time the
+# native -O2 binaries built with and without the layout.
+INPUT=${1}
+RUNS=${RUNS:-5}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+PLUGIN=../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}
+
+./buildAndTest.sh ${INPUT} > support/${INPUT}.profile && \
+    ${BIN}/opt -load ${PLUGIN} -cs201-layout -cs201-profile-use=support/${INPUT}.profile support/${INPUT}.bc -o support/${INPUT}.layout.bc && \
+    clang -O2 support/${INPUT}.bc -o support/${INPUT}.base && \
+    clang -O2 support/${INPUT}.layout.bc -o support/${INPUT}.layout || exit 1
+
+for VARIANT in base layout; do
+    echo "${VARIANT}:"
+    for i in $(seq ${RUNS}); do
+        /usr/bin/time -f "%e s" support/${INPUT}.${VARIANT} > /dev/null
+    done
+done
@@ -0,0 +1,31 @@
+
+# Pass time and peak memory of -pathProfiling on generated CFGs of growing
+# size (tools/cs201-gen). Prints CSV; a quadratic step shows up as a 100x
+# jump between sizes that differ by 10x.
+SHAPES=${SHAPES:-"chain switch loops mesh functions"}
+SIZES=${SIZES:-"10 100 1000 10000"}
+# extra pass options, e.g. PROFILE_FLAGS=-profile-analysis-cache=/tmp/cs201.cache
+# (run twice: the second run shows the cached rebuild)
+PROFILE_FLAGS=${PROFILE_FLAGS}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+PLUGIN=../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}
+OUT=$(mktemp -d)
+
+echo "shape,size,blocks,seconds,max_rss_kb"
+for SHAPE in ${SHAPES}; do
+    for SIZE in ${SIZES}; do
+        ${BIN}/cs201-gen -shape=${SHAPE} -size=${SIZE} -o ${OUT}/gen.bc || exit 1
+        BLOCKS=$(${BIN}/llvm-dis ${OUT}/gen.bc -o - | grep -c '^[A-Za-z0-9_.]*:')
+        # the pass logs every block to stderr; keep that out of the measurement
+        /usr/bin/time -f "%e,%M" -o ${OUT}/time.txt \
+            ${BIN}/opt -load ${PLUGIN} -pathProfiling ${PROFILE_FLAGS} ${OUT}/gen.bc -o /dev/null 2> /dev/null
+        echo "${SHAPE},${SIZE},${BLOCKS},$(cat ${OUT}/time.txt)"
+    done
+done
+rm -rf ${OUT}
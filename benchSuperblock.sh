@@ -0,0 +1,30 @@
+# Profile each input, form superblocks with -cs201-superblock and time the
+# native -O2 binaries built with and without them. The profiled run uses the
+# program's default size, the timed runs ${ARGS}.
+INPUTS=${INPUTS:-branchy}
+ARGS=${ARGS:-100000000}
+RUNS=${RUNS:-5}
+# extra pass options, e.g. SUPERBLOCK_FLAGS=-cs201-superblock-growth=100
+SUPERBLOCK_FLAGS=${SUPERBLOCK_FLAGS}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+PLUGIN=../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}
+
+for INPUT in ${INPUTS}; do
+    ./buildAndTest.sh ${INPUT} > support/${INPUT}.profile && \
+        ${BIN}/opt -load ${PLUGIN} -cs201-superblock -cs201-profile-use=support/${INPUT}.profile ${SUPERBLOCK_FLAGS} -verify support/${INPUT}.bc -o support/${INPUT}.sb.bc && \
+        clang -O2 support/${INPUT}.bc -o support/${INPUT}.base && \
+        clang -O2 support/${INPUT}.sb.bc -o support/${INPUT}.sb || exit 1
+
+    for VARIANT in base sb; do
+        echo "${INPUT} ${VARIANT}:"
+        for i in $(seq ${RUNS}); do
+            /usr/bin/time -f "%e s" support/${INPUT}.${VARIANT} ${ARGS} > /dev/null
+        done
+    done
+done
@@ -1,4 +1,12 @@
+
 INPUT=${1}
+# extra pass options, e.g. PROFILE_FLAGS=-profile-timing ./buildAndTest.sh test
+PROFILE_FLAGS=${PROFILE_FLAGS}
+# compiler options for the input, e.g. CLANG_FLAGS=-O2 to profile optimized code
+CLANG_FLAGS=${CLANG_FLAGS}
+# coverage encodings to rerun the input under, e.g. COVERAGE_MODES="byte bit";
+# off by default since callers save the output as a profile
+COVERAGE_MODES=${COVERAGE_MODES}
 LLVM_HOME=~/Workspace
 if [ $(uname -s) == "Darwin" ]; then
     SHARED_LIB_EXT=dylib;
@@ -6,10 +14,26 @@ else
     SHARED_LIB_EXT=so;
 fi
 
-clang -emit-llvm support/${INPUT}.c -c -o support/${INPUT}.bc && \
+if [ -f support/${INPUT}.cpp ]; then
+    SOURCE="clang++ support/${INPUT}.cpp";
+else
+    SOURCE="clang support/${INPUT}.c";
+fi
+
+${SOURCE} -emit-llvm ${CLANG_FLAGS} -c -o support/${INPUT}.bc && \
     make clean && \
     make && \
-    ${LLVM_HOME}/llvm/Release+Asserts/bin/opt -load ../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT} -pathProfiling support/${INPUT}.bc -S -o support/${INPUT}.ll && \
+    for RT in runtime/*.c; do clang -emit-llvm -O2 -c ${RT} -o ${RT%.c}.bc || exit 1; done && \
+    ${LLVM_HOME}/llvm/Release+Asserts/bin/opt -load ../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT} -pathProfiling ${PROFILE_FLAGS} -verify support/${INPUT}.bc -S -o support/${INPUT}.ll && \
     ${LLVM_HOME}/llvm/Release+Asserts/bin/llvm-as support/${INPUT}.ll -o support/${INPUT}.bb.bc && \
-    ${LLVM_HOME}/llvm/Release+Asserts/bin/lli support/${INPUT}.bb.bc
+    ${LLVM_HOME}/llvm/Release+Asserts/bin/llvm-link support/${INPUT}.bb.bc runtime/*.bc -o support/${INPUT}.prof.bc && \
+    ${LLVM_HOME}/llvm/Release+Asserts/bin/lli support/${INPUT}.prof.bc || exit 1
 
+# coverage dumps read bitmap slots, except for the CFG checksum rows; rerun the
+# input under each listed encoding so a bad slot shows up as a crash or garbage
+for MODE in ${COVERAGE_MODES}; do
+    echo "== -profile-coverage=${MODE}"
+    ${LLVM_HOME}/llvm/Release+Asserts/bin/opt -load ../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT} -pathProfiling ${PROFILE_FLAGS} -profile-coverage=${MODE} -verify support/${INPUT}.bc -o support/${INPUT}.cov.bc && \
+        ${LLVM_HOME}/llvm/Release+Asserts/bin/llvm-link support/${INPUT}.cov.bc runtime/*.bc -o support/${INPUT}.cov.prof.bc && \
+        ${LLVM_HOME}/llvm/Release+Asserts/bin/lli support/${INPUT}.cov.prof.bc || exit 1
+done
@@ -0,0 +1,242 @@
+/*
+ * Allocation-site profiling for -profile-alloc.
+ *
+ * The pass calls __cs201_alloc after every malloc, calloc, realloc and
+ * operator new with the site's number, and __cs201_free before every free,
+ * realloc and operator delete. Counts, bytes and a power-of-two size-class
+ * histogram go into per-thread buffers that are summed at the dump. Live
+ * bytes need the site of a block when it is freed, possibly by another
+ * thread, so every live block is kept in a table sharded by address, and the
+ * per-site live bytes and their high-water marks are updated atomically.
+ * Blocks allocated by code that was not instrumented are not in the table
+ * and their frees are ignored.
+ */
+#include "CS201Runtime.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIZE_CLASSES 20 /* <= 8 bytes, <= 16, ..., > 2 MB */
+#define SHARDS 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t frees;
+    uint64_t classes[SIZE_CLASSES];
+} cs201_site_stats;
+
+typedef struct cs201_alloc_thread {
+    cs201_site_stats *sites;
+    struct cs201_alloc_thread *next;
+} cs201_alloc_thread;
+
+typedef struct cs201_block {
+    uintptr_t ptr;
+    uint64_t size;
+    uint32_t site;
+    struct cs201_block *next;
+} cs201_block;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cs201_block **buckets;
+    uint32_t numBuckets;
+    uint32_t numBlocks;
+} cs201_shard;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cs201_alloc_thread *threads = NULL;
+static __thread cs201_alloc_thread *self = NULL;
+static const cs201_alloc_site *sites = NULL;
+static uint32_t numSites = 0;
+static uint32_t top = 20;
+static uint64_t *live = NULL;
+static uint64_t *highWater = NULL;
+static uint64_t totalLive = 0;
+static uint64_t totalHighWater = 0;
+static cs201_shard shards[SHARDS];
+
+void __cs201_alloc_init(const cs201_alloc_site *table, uint32_t n, uint32_t report) {
+    sites = table;
+    numSites = n;
+    top = report;
+    live = calloc(n ? n : 1, sizeof(uint64_t));
+    highWater = calloc(n ? n : 1, sizeof(uint64_t));
+    for (uint32_t i = 0; i < SHARDS; ++i)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static cs201_alloc_thread *thread(void) {
+    if (!self) {
+        self = calloc(1, sizeof(cs201_alloc_thread));
+        self->sites = calloc(numSites ? numSites : 1, sizeof(cs201_site_stats));
+        pthread_mutex_lock(&lock);
+        self->next = threads;
+        threads = self;
+        pthread_mutex_unlock(&lock);
+    }
+    return self;
+}
+
+static uint32_t sizeClass(uint64_t size) {
+    uint32_t c = 0;
+    while (c + 1 < SIZE_CLASSES && size > (8ull << c))
+        ++c;
+    return c;
+}
+
+static uint64_t hashPtr(uintptr_t ptr) {
+    return (ptr >> 4) * 0x9e3779b97f4a7c15ull;
+}
+
+static void raiseMark(uint64_t *mark, uint64_t value) {
+    uint64_t old = __atomic_load_n(mark, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(mark, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void grow(cs201_shard *s) {
+    uint32_t n = s->numBuckets ? s->numBuckets * 2 : 256;
+    cs201_block **buckets = calloc(n, sizeof(cs201_block *));
+    for (uint32_t i = 0; i < s->numBuckets; ++i) {
+        while (s->buckets[i]) {
+            cs201_block *b = s->buckets[i];
+            s->buckets[i] = b->next;
+            uint32_t slot = (hashPtr(b->ptr) / SHARDS) % n;
+            b->next = buckets[slot];
+            buckets[slot] = b;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->numBuckets = n;
+}
+
+void __cs201_alloc(uint32_t site, void *ptr, uint64_t size) {
+    if (!ptr || site >= numSites)
+        return;
+    cs201_site_stats *st = &thread()->sites[site];
+    st->count++;
+    st->bytes += size;
+    st->classes[sizeClass(size)]++;
+
+    uintptr_t key = (uintptr_t)ptr;
+    cs201_shard *s = &shards[hashPtr(key) % SHARDS];
+    cs201_block *b = malloc(sizeof(cs201_block));
+    b->ptr = key;
+    b->size = size;
+    b->site = site;
+    pthread_mutex_lock(&s->lock);
+    if (s->numBlocks >= s->numBuckets)
+        grow(s);
+    uint32_t slot = (hashPtr(key) / SHARDS) % s->numBuckets;
+    b->next = s->buckets[slot];
+    s->buckets[slot] = b;
+    s->numBlocks++;
+    pthread_mutex_unlock(&s->lock);
+
+    raiseMark(&highWater[site], __atomic_add_fetch(&live[site], size, __ATOMIC_RELAXED));
+    raiseMark(&totalHighWater, __atomic_add_fetch(&totalLive, size, __ATOMIC_RELAXED));
+}
+
+void __cs201_free(void *ptr) {
+    uintptr_t key = (uintptr_t)ptr;
+    cs201_shard *s = &shards[hashPtr(key) % SHARDS];
+    cs201_block *found = NULL;
+    if (!ptr)
+        return;
+    pthread_mutex_lock(&s->lock);
+    if (s->numBuckets) {
+        cs201_block **link = &s->buckets[(hashPtr(key) / SHARDS) % s->numBuckets];
+        while (*link && (*link)->ptr != key)
+            link = &(*link)->next;
+        if (*link) {
+            found = *link;
+            *link = found->next;
+            s->numBlocks--;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!found)
+        return;
+    thread()->sites[found->site].frees++;
+    __atomic_sub_fetch(&live[found->site], found->size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&totalLive, found->size, __ATOMIC_RELAXED);
+    free(found);
+}
+
+static cs201_site_stats *sums = NULL;
+
+static int byBytes(const void *a, const void *b) {
+    uint64_t x = sums[*(const uint32_t *)a].bytes;
+    uint64_t y = sums[*(const uint32_t *)b].bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int byCount(const void *a, const void *b) {
+    uint64_t x = sums[*(const uint32_t *)a].count;
+    uint64_t y = sums[*(const uint32_t *)b].count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void printSite(uint32_t i) {
+    const cs201_alloc_site *site = &sites[i];
+    cs201_site_stats *st = &sums[i];
+    printf("%s %s %s: count %llu bytes %llu avg %llu frees %llu live %llu high-water %llu",
+           site->function, site->block, site->callee, (unsigned long long)st->count,
+           (unsigned long long)st->bytes, (unsigned long long)(st->bytes / st->count),
+           (unsigned long long)st->frees, (unsigned long long)live[i], (unsigned long long)highWater[i]);
+    if (site->loop)
+        printf(" [loop %s]", site->loop);
+    printf("\n  sizes");
+    for (uint32_t c = 0; c < SIZE_CLASSES; ++c) {
+        if (st->classes[c])
+            printf(" %s%llu:%llu", c + 1 == SIZE_CLASSES ? ">" : "<=",
+                   (unsigned long long)(8ull << (c + 1 == SIZE_CLASSES ? c - 1 : c)),
+                   (unsigned long long)st->classes[c]);
+    }
+    printf("\n");
+}
+
+void __cs201_alloc_dump(void) {
+    uint32_t *order = malloc((numSites ? numSites : 1) * sizeof(uint32_t));
+    uint32_t n = 0, inLoops = 0;
+
+    pthread_mutex_lock(&lock);
+    sums = calloc(numSites ? numSites : 1, sizeof(cs201_site_stats));
+    for (uint32_t i = 0; i < numSites; ++i) {
+        for (cs201_alloc_thread *t = threads; t; t = t->next) {
+            sums[i].count += t->sites[i].count;
+            sums[i].bytes += t->sites[i].bytes;
+            sums[i].frees += t->sites[i].frees;
+            for (uint32_t c = 0; c < SIZE_CLASSES; ++c)
+                sums[i].classes[c] += t->sites[i].classes[c];
+        }
+        if (sums[i].count)
+            order[n++] = i;
+    }
+    pthread_mutex_unlock(&lock);
+
+    printf("\nALLOCATION PROFILING (live %llu bytes, high-water %llu bytes):\n",
+           (unsigned long long)__atomic_load_n(&totalLive, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&totalHighWater, __ATOMIC_RELAXED));
+    qsort(order, n, sizeof(uint32_t), byBytes);
+    for (uint32_t i = 0; i < n && i < top; ++i)
+        printSite(order[i]);
+
+    /* allocations repeated by a loop are the arena and pool candidates */
+    qsort(order, n, sizeof(uint32_t), byCount);
+    for (uint32_t i = 0; i < n && inLoops < top; ++i) {
+        if (!sites[order[i]].loop)
+            continue;
+        if (!inLoops++)
+            printf("\nALLOCATION SITES IN LOOPS (by count):\n");
+        printSite(order[i]);
+    }
+    free(order);
+    free(sums);
+    sums = NULL;
+}
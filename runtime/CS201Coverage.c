@@ -0,0 +1,161 @@
+/*
+ * Coverage bitmaps for -profile-coverage.
+ *
+ * The probes write straight into the per-function bitmaps emitted by the
+ * pass; nothing here runs until main returns. The dump ORs this run's
+ * bitmaps into the ones already stored in CS201_COVERAGE_FILE (default
+ * "cs201.cov"), so repeated runs accumulate into a single file. The update
+ * holds an flock on "<file>.lock", so concurrent processes do not lose bits.
+ *
+ * File layout: "CS201COV" followed by records of
+ *   uint32 nameLength, name, uint32 size, size bytes of bitmap.
+ */
+#include "CS201Runtime.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    char *name;
+    uint8_t *map;
+    uint32_t size;
+} cs201_bitmap;
+
+static const char magic[8] = {'C', 'S', '2', '0', '1', 'C', 'O', 'V'};
+static cs201_bitmap *bitmaps = NULL;
+static uint32_t numBitmaps = 0;
+
+/* dst |= src, 16 bytes at a time */
+static void orBytes(uint8_t *dst, const uint8_t *src, uint32_t size) {
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+    }
+#endif
+    for (; i < size; ++i)
+        dst[i] |= src[i];
+}
+
+static cs201_bitmap *findBitmap(cs201_bitmap *maps, uint32_t n, const char *name, uint32_t size) {
+    for (uint32_t i = 0; i < n; ++i) {
+        if (maps[i].size == size && strcmp(maps[i].name, name) == 0)
+            return &maps[i];
+    }
+    return NULL;
+}
+
+void __cs201_coverage_add(const char *func, uint8_t *map, uint32_t size) {
+    bitmaps = realloc(bitmaps, (numBitmaps + 1) * sizeof(cs201_bitmap));
+    bitmaps[numBitmaps].name = strdup(func);
+    bitmaps[numBitmaps].map = map;
+    bitmaps[numBitmaps].size = size;
+    ++numBitmaps;
+}
+
+/* Reads every record of an existing coverage file; returns 0 if there is none. */
+static uint32_t readCoverage(const char *path, cs201_bitmap **out) {
+    FILE *f = fopen(path, "rb");
+    char header[sizeof(magic)];
+    cs201_bitmap *maps = NULL;
+    uint32_t n = 0;
+    uint32_t length, size;
+
+    *out = NULL;
+    if (!f)
+        return 0;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, magic, sizeof(magic)) != 0) {
+        fprintf(stderr, "cs201: ignoring malformed coverage file %s\n", path);
+        fclose(f);
+        return 0;
+    }
+    while (fread(&length, sizeof(length), 1, f) == 1) {
+        char *name = malloc(length + 1);
+        if (fread(name, 1, length, f) != length || fread(&size, sizeof(size), 1, f) != 1) {
+            free(name);
+            break;
+        }
+        name[length] = '\0';
+        uint8_t *map = malloc(size ? size : 1);
+        if (fread(map, 1, size, f) != size) {
+            free(name);
+            free(map);
+            break;
+        }
+        maps = realloc(maps, (n + 1) * sizeof(cs201_bitmap));
+        maps[n].name = name;
+        maps[n].map = map;
+        maps[n].size = size;
+        ++n;
+    }
+    fclose(f);
+    *out = maps;
+    return n;
+}
+
+static void writeRecord(FILE *f, const cs201_bitmap *m) {
+    uint32_t length = strlen(m->name);
+    fwrite(&length, sizeof(length), 1, f);
+    fwrite(m->name, 1, length, f);
+    fwrite(&m->size, sizeof(m->size), 1, f);
+    fwrite(m->map, 1, m->size, f);
+}
+
+void __cs201_coverage_dump(void) {
+    const char *path = getenv("CS201_COVERAGE_FILE");
+    cs201_bitmap *old;
+    uint32_t numOld;
+    char tmp[4096];
+    FILE *f;
+    int lock;
+
+    if (!path)
+        path = "cs201.cov";
+    snprintf(tmp, sizeof(tmp), "%s.lock", path);
+    lock = open(tmp, O_RDWR | O_CREAT, 0644);
+    if (lock >= 0)
+        flock(lock, LOCK_EX);
+    numOld = readCoverage(path, &old);
+    for (uint32_t i = 0; i < numBitmaps; ++i) {
+        cs201_bitmap *prev = findBitmap(old, numOld, bitmaps[i].name, bitmaps[i].size);
+        if (prev)
+            orBytes(prev->map, bitmaps[i].map, prev->size);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "cs201: cannot write coverage file %s\n", tmp);
+    }
+    else {
+        fwrite(magic, 1, sizeof(magic), f);
+        for (uint32_t i = 0; i < numOld; ++i)
+            writeRecord(f, &old[i]);
+        for (uint32_t i = 0; i < numBitmaps; ++i) {
+            if (!findBitmap(old, numOld, bitmaps[i].name, bitmaps[i].size))
+                writeRecord(f, &bitmaps[i]);
+        }
+        fclose(f);
+        if (rename(tmp, path) != 0)
+            fprintf(stderr, "cs201: cannot replace coverage file %s\n", path);
+    }
+    if (lock >= 0) {
+        flock(lock, LOCK_UN);
+        close(lock);
+    }
+
+    for (uint32_t i = 0; i < numOld; ++i) {
+        free(old[i].name);
+        free(old[i].map);
+    }
+    free(old);
+}
@@ -0,0 +1,205 @@
+/*
+ * Cross-iteration path traces for -profile-loop-paths=k.
+ *
+ * Each iteration of an instrumented loop ends with the Ball-Larus number of
+ * the path it took through the body, inner loops counting as one node. Every
+ * thread keeps, per loop, the last k of those numbers and a bounded
+ * open-addressed table of the k-long sequences seen; a sequence that finds
+ * no free slot within a few probes is only counted as dropped. The dump
+ * merges the threads' tables and prints each loop's most frequent traces,
+ * decoded back into blocks with the edge table emitted by the pass.
+ *
+ * Leaving a loop through an exit edge starts its next entry with an empty
+ * window. A return from inside the loop does not, so that window carries
+ * over into the next activation.
+ */
+#include "CS201Runtime.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROBES 8
+
+typedef struct {
+    uint32_t window[CS201_LOOP_PATH_MAX_K];
+    uint32_t filled;
+    uint32_t next; /* oldest entry once the window is full */
+    uint64_t iterations;
+    uint64_t dropped;
+    uint64_t *counts;  /* tableSize entries, 0 = free */
+    uint32_t *traces;  /* tableSize * k path numbers */
+} cs201_loop_state;
+
+typedef struct cs201_path_thread {
+    cs201_loop_state *loops;
+    struct cs201_path_thread *next;
+} cs201_path_thread;
+
+typedef struct {
+    uint64_t count;
+    const uint32_t *trace;
+} cs201_trace;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cs201_path_thread *threads = NULL;
+static __thread cs201_path_thread *self = NULL;
+static const cs201_loop_desc *loops = NULL;
+static uint32_t numLoops = 0;
+static uint32_t k = 1;
+static uint32_t tableSize = 1024;
+static uint32_t top = 10;
+
+void __cs201_loop_paths_init(const cs201_loop_desc *table, uint32_t n, uint32_t length,
+                             uint32_t size, uint32_t report) {
+    loops = table;
+    numLoops = n;
+    k = length < 1 ? 1 : length > CS201_LOOP_PATH_MAX_K ? CS201_LOOP_PATH_MAX_K : length;
+    tableSize = size ? size : 1;
+    top = report;
+}
+
+static cs201_path_thread *thread(void) {
+    if (!self) {
+        self = calloc(1, sizeof(cs201_path_thread));
+        self->loops = calloc(numLoops ? numLoops : 1, sizeof(cs201_loop_state));
+        pthread_mutex_lock(&lock);
+        self->next = threads;
+        threads = self;
+        pthread_mutex_unlock(&lock);
+    }
+    return self;
+}
+
+static void record(cs201_loop_state *s) {
+    uint32_t seq[CS201_LOOP_PATH_MAX_K];
+    uint64_t hash = 14695981039346656037ull;
+
+    for (uint32_t i = 0; i < k; ++i) {
+        seq[i] = s->window[(s->next + i) % k];
+        hash = (hash ^ seq[i]) * 1099511628211ull;
+    }
+    if (!s->counts) {
+        s->counts = calloc(tableSize, sizeof(uint64_t));
+        s->traces = malloc((size_t)tableSize * k * sizeof(uint32_t));
+    }
+    for (uint32_t p = 0; p < PROBES; ++p) {
+        uint32_t slot = (hash + p) % tableSize;
+        uint32_t *trace = s->traces + (size_t)slot * k;
+        if (!s->counts[slot]) {
+            memcpy(trace, seq, k * sizeof(uint32_t));
+            s->counts[slot] = 1;
+            return;
+        }
+        if (memcmp(trace, seq, k * sizeof(uint32_t)) == 0) {
+            s->counts[slot]++;
+            return;
+        }
+    }
+    s->dropped++;
+}
+
+void __cs201_loop_path(uint32_t loop, uint32_t path, uint32_t exiting) {
+    if (loop >= numLoops)
+        return;
+    cs201_loop_state *s = &thread()->loops[loop];
+    s->iterations++;
+    s->window[s->next] = path;
+    s->next = (s->next + 1) % k;
+    if (s->filled < k)
+        s->filled++;
+    if (s->filled == k)
+        record(s);
+    if (exiting) {
+        s->filled = 0;
+        s->next = 0;
+    }
+}
+
+static int byTrace(const void *a, const void *b) {
+    return memcmp(((const cs201_trace *)a)->trace, ((const cs201_trace *)b)->trace, k * sizeof(uint32_t));
+}
+
+static int byCount(const void *a, const void *b) {
+    uint64_t x = ((const cs201_trace *)a)->count;
+    uint64_t y = ((const cs201_trace *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Ball-Larus decoding: from the header, take the edge with the largest
+   increment that still fits in what is left of the path number */
+static void printPath(const cs201_loop_desc *d, uint32_t path) {
+    int32_t node = 0;
+    for (;;) {
+        const cs201_path_edge *best = NULL;
+        for (uint32_t e = 0; e < d->numEdges; ++e) {
+            const cs201_path_edge *edge = &d->edges[e];
+            if (edge->from == node && edge->value <= path && (!best || edge->value > best->value))
+                best = edge;
+        }
+        printf(" %s", d->nodes[node]);
+        if (!best) {
+            printf(" ?");
+            return;
+        }
+        path -= best->value;
+        if (best->to < 0) {
+            printf(" (%s)", best->label);
+            return;
+        }
+        node = best->to;
+    }
+}
+
+void __cs201_loop_paths_dump(void) {
+    pthread_mutex_lock(&lock);
+    printf("\nLOOP PATH PROFILING (k = %u):\n", k);
+    for (uint32_t l = 0; l < numLoops; ++l) {
+        uint64_t iterations = 0, dropped = 0;
+        uint32_t n = 0, distinct = 0;
+        for (cs201_path_thread *t = threads; t; t = t->next) {
+            iterations += t->loops[l].iterations;
+            dropped += t->loops[l].dropped;
+            for (uint32_t slot = 0; t->loops[l].counts && slot < tableSize; ++slot)
+                n += t->loops[l].counts[slot] != 0;
+        }
+        if (!iterations)
+            continue;
+
+        cs201_trace *all = malloc((n ? n : 1) * sizeof(cs201_trace));
+        n = 0;
+        for (cs201_path_thread *t = threads; t; t = t->next) {
+            for (uint32_t slot = 0; t->loops[l].counts && slot < tableSize; ++slot) {
+                if (t->loops[l].counts[slot]) {
+                    all[n].count = t->loops[l].counts[slot];
+                    all[n].trace = t->loops[l].traces + (size_t)slot * k;
+                    ++n;
+                }
+            }
+        }
+        /* the same trace can sit in several threads' tables */
+        qsort(all, n, sizeof(cs201_trace), byTrace);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (distinct && byTrace(&all[distinct - 1], &all[i]) == 0)
+                all[distinct - 1].count += all[i].count;
+            else
+                all[distinct++] = all[i];
+        }
+        qsort(all, distinct, sizeof(cs201_trace), byCount);
+
+        printf("%s: iterations %llu, paths %u, traces %u, dropped %llu\n", loops[l].name,
+               (unsigned long long)iterations, loops[l].numPaths, distinct, (unsigned long long)dropped);
+        for (uint32_t i = 0; i < distinct && i < top; ++i) {
+            printf("  %llu:", (unsigned long long)all[i].count);
+            for (uint32_t j = 0; j < k; ++j) {
+                if (j)
+                    printf(" |");
+                printPath(&loops[l], all[i].trace[j]);
+            }
+            printf("\n");
+        }
+        free(all);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,160 @@
+/*
+ * Hardware counters through perf_event_open.
+ *
+ * Each thread opens one group for itself (cycles, instructions, cache misses,
+ * branch misses), user space only. Where the kernel allows rdpmc the counters
+ * are read from the group's mmap'd pages without a system call; otherwise,
+ * and always for software events, with read(). Machines without a usable
+ * PMU (most VMs) get task-clock, page faults, context switches and CPU
+ * migrations instead; CS201_PERF=software forces that set. A thread's group
+ * is closed and unmapped when the thread exits.
+ */
+#define _GNU_SOURCE
+#include "CS201Perf.h"
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} cs201_event;
+
+static const cs201_event hardware[CS201_PERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+
+static const cs201_event software[CS201_PERF_EVENTS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu-migrations"},
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t groupKey;
+static const cs201_event *events = NULL;
+static const char *names[CS201_PERF_EVENTS];
+
+static int openEvent(const cs201_event *e, int leader) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = e->type;
+    attr.config = e->config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+static void closeGroup(void *g) {
+    cs201_perf_close(g);
+}
+
+/* the first thread decides which event set every thread uses */
+static void chooseEvents(void) {
+    const char *mode = getenv("CS201_PERF");
+    pthread_key_create(&groupKey, closeGroup);
+    events = software;
+    if (!(mode && strcmp(mode, "software") == 0)) {
+        int fd = openEvent(&hardware[0], -1);
+        if (fd >= 0) {
+            events = hardware;
+            close(fd);
+        }
+    }
+    for (int i = 0; i < CS201_PERF_EVENTS; ++i)
+        names[i] = events[i].name;
+}
+
+int cs201_perf_open(cs201_perf_group *g) {
+    pthread_once(&once, chooseEvents);
+    memset(g, 0, sizeof(*g));
+    for (int i = 0; i < CS201_PERF_EVENTS; ++i) {
+        g->fds[i] = openEvent(&events[i], i ? g->fds[0] : -1);
+        g->pages[i] = NULL;
+        if (g->fds[i] < 0)
+            continue;
+        void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, g->fds[i], 0);
+        if (page != MAP_FAILED)
+            g->pages[i] = page;
+    }
+    g->open = g->fds[0] >= 0;
+    if (g->open)
+        pthread_setspecific(groupKey, g);
+    return g->open;
+}
+
+void cs201_perf_close(cs201_perf_group *g) {
+    for (int i = 0; i < CS201_PERF_EVENTS; ++i) {
+        if (g->pages[i])
+            munmap(g->pages[i], sysconf(_SC_PAGESIZE));
+        if (g->fds[i] >= 0)
+            close(g->fds[i]);
+        g->pages[i] = NULL;
+        g->fds[i] = -1;
+    }
+    g->open = 0;
+}
+
+/* the seqlock protocol from linux/perf_event.h */
+static int readPage(const struct perf_event_mmap_page *pc, uint64_t *value) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t seq, index;
+    uint64_t count;
+    do {
+        seq = pc->lock;
+        __sync_synchronize();
+        index = pc->index;
+        count = pc->offset;
+        if (!pc->cap_user_rdpmc || !index)
+            return 0;
+        /* sign-extend the pmc_width-bit value: shift left unsigned (a negative
+         * signed left shift is undefined), then back arithmetically */
+        int shift = 64 - pc->pmc_width;
+        int64_t pmc = (int64_t)((uint64_t)__rdpmc(index - 1) << shift) >> shift;
+        count += pmc;
+        __sync_synchronize();
+    } while (pc->lock != seq);
+    *value = count;
+    return 1;
+#else
+    (void)pc;
+    (void)value;
+    return 0;
+#endif
+}
+
+void cs201_perf_read(const cs201_perf_group *g, uint64_t *values) {
+    for (int i = 0; i < CS201_PERF_EVENTS; ++i) {
+        values[i] = 0;
+        if (g->fds[i] < 0)
+            continue;
+        if (g->pages[i] && readPage(g->pages[i], &values[i]))
+            continue;
+        if (read(g->fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            values[i] = 0;
+    }
+}
+
+const char *const *cs201_perf_names(void) {
+    pthread_once(&once, chooseEvents);
+    return names;
+}
+
+const char *cs201_perf_kind(void) {
+    pthread_once(&once, chooseEvents);
+    return events == hardware ? "hardware" : "software";
+}
@@ -0,0 +1,27 @@
+/*
+ * perf_event_open counter groups for -profile-perf, shared by the timing
+ * runtime. Not part of the ABI the pass calls.
+ */
+#ifndef CS201_PERF_H
+#define CS201_PERF_H
+
+#include <stdint.h>
+
+#define CS201_PERF_EVENTS 4
+
+typedef struct {
+    int fds[CS201_PERF_EVENTS];
+    void *pages[CS201_PERF_EVENTS]; /* mmap'd control pages, for rdpmc */
+    int open;
+} cs201_perf_group;
+
+/* opens this thread's group; 0 if perf_event_open is not available at all.
+   g must stay valid until the thread exits, which closes it. */
+int cs201_perf_open(cs201_perf_group *g);
+void cs201_perf_close(cs201_perf_group *g);
+void cs201_perf_read(const cs201_perf_group *g, uint64_t *values);
+/* event names, and whether they are hardware or software events */
+const char *const *cs201_perf_names(void);
+const char *cs201_perf_kind(void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Profile file output for -profile-file.
+ *
+ * A constructor emitted by the pass registers the module's descriptor table.
+ * From then on a forked child starts with zeroed counters, and every process
+ * writes its own counts from atexit to the file named by the pattern:
+ *   %p  pid,  %h  host name,  %m  module hash,  %%  a literal '%'.
+ * With CS201_PROFILE_MERGE the file is locked with flock and the counts
+ * already in it are added in, so any number of processes can share one file.
+ *
+ * The file has the same layout as the printf dump, so ProfileData reads it.
+ */
+#define _GNU_SOURCE
+#include "CS201Runtime.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+typedef struct {
+    const cs201_desc *table;
+    uint32_t rows;
+    void (*fixup)(void);
+    const char *pattern;
+    uint64_t moduleHash;
+    uint32_t flags;
+} cs201_module;
+
+static cs201_module *modules = NULL;
+static uint32_t numModules = 0;
+static int registered = 0;
+
+/* kind 3 rows hold the CFG checksums: constants, never reset or summed */
+#define CS201_KIND_CFG 3
+
+static const char *titles[] = {"BASIC BLOCK PROFILING:", "EDGE PROFILING:", "LOOP PROFILING:", "CFG CHECKSUMS:"};
+
+static uint64_t readCounter(const cs201_module *m, const cs201_desc *d) {
+    if (d->slot < 0)
+        return *(uint32_t *)d->counter;
+    if (m->flags & CS201_PROFILE_BITMAP)
+        return (((uint8_t *)d->counter)[d->slot / 8] >> (d->slot % 8)) & 1;
+    return ((uint8_t *)d->counter)[d->slot] != 0;
+}
+
+static void resetCounter(const cs201_module *m, const cs201_desc *d) {
+    if (d->slot < 0)
+        *(uint32_t *)d->counter = 0;
+    else if (m->flags & CS201_PROFILE_BITMAP)
+        ((uint8_t *)d->counter)[d->slot / 8] &= ~(1u << (d->slot % 8));
+    else
+        ((uint8_t *)d->counter)[d->slot] = 0;
+}
+
+/* the child only reports what it executes itself */
+static void resetInChild(void) {
+    for (uint32_t i = 0; i < numModules; ++i) {
+        for (uint32_t r = 0; r < modules[i].rows; ++r) {
+            if (modules[i].table[r].name && modules[i].table[r].kind != CS201_KIND_CFG)
+                resetCounter(&modules[i], &modules[i].table[r]);
+        }
+    }
+}
+
+static void expandPattern(const cs201_module *m, char *out, size_t size) {
+    size_t n = 0;
+    char piece[256];
+    for (const char *p = m->pattern; *p && n + 1 < size; ++p) {
+        if (*p != '%' || !p[1]) {
+            out[n++] = *p;
+            continue;
+        }
+        ++p;
+        if (*p == 'p')
+            snprintf(piece, sizeof(piece), "%ld", (long)getpid());
+        else if (*p == 'h') {
+            if (gethostname(piece, sizeof(piece)) != 0)
+                strcpy(piece, "unknown");
+            piece[sizeof(piece) - 1] = '\0';
+        }
+        else if (*p == 'm')
+            snprintf(piece, sizeof(piece), "%016llx", (unsigned long long)m->moduleHash);
+        else
+            snprintf(piece, sizeof(piece), "%c", *p);
+        size_t len = strlen(piece);
+        if (n + len >= size)
+            break;
+        memcpy(out + n, piece, len);
+        n += len;
+    }
+    out[n] = '\0';
+}
+
+/* Adds the counts of an existing profile into sums[], matched by section,
+   function and name. Lines that match no row are dropped. */
+static void mergeExisting(const cs201_module *m, FILE *f, uint64_t *sums) {
+    char line[4096];
+    /* as large as line, so any "Function: " line fits */
+    char function[sizeof(line)] = "";
+    int section = -1;
+    uint32_t hint = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        int title = -1;
+        for (int k = 0; k < 4; ++k) {
+            if (strcmp(line, titles[k]) == 0)
+                title = k;
+        }
+        if (title >= 0) {
+            section = title;
+            function[0] = '\0';
+            continue;
+        }
+        if (strncmp(line, "Function: ", 10) == 0) {
+            snprintf(function, sizeof(function), "%s", line + 10);
+            continue;
+        }
+        char *colon = strrchr(line, ':');
+        if (section < 0 || !colon)
+            continue;
+        *colon = '\0';
+        unsigned long long count = strtoull(colon + 1, NULL, 10);
+        /* the file is in table order, so the next row is almost always the match */
+        for (uint32_t k = 0; k < m->rows; ++k) {
+            uint32_t r = (hint + k) % m->rows;
+            const cs201_desc *d = &m->table[r];
+            if (!d->name || (int)d->kind != section || strcmp(d->name, line) != 0)
+                continue;
+            if (d->function && strcmp(d->function, function) != 0)
+                continue;
+            /* the checksums are this build's, whatever the file had */
+            if (d->slot >= 0)
+                sums[r] |= count != 0;
+            else if (d->kind != CS201_KIND_CFG)
+                sums[r] += count;
+            hint = r + 1;
+            break;
+        }
+    }
+}
+
+static void writeModule(const cs201_module *m) {
+    char path[4096];
+    uint64_t *sums = calloc(m->rows ? m->rows : 1, sizeof(uint64_t));
+    const char *lastFunction = NULL;
+    int fd;
+    FILE *f;
+
+    if (m->fixup)
+        m->fixup();
+    for (uint32_t r = 0; r < m->rows; ++r) {
+        if (m->table[r].name)
+            sums[r] = readCounter(m, &m->table[r]);
+    }
+
+    expandPattern(m, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || !(f = fdopen(fd, "r+"))) {
+        fprintf(stderr, "cs201: cannot open profile file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        free(sums);
+        return;
+    }
+    if (m->flags & CS201_PROFILE_MERGE) {
+        flock(fd, LOCK_EX);
+        mergeExisting(m, f, sums);
+        rewind(f);
+    }
+    if (ftruncate(fd, 0) != 0)
+        fprintf(stderr, "cs201: cannot truncate profile file %s\n", path);
+
+    for (uint32_t r = 0; r < m->rows; ++r) {
+        const cs201_desc *d = &m->table[r];
+        if (!d->name) {
+            fprintf(f, "%s%s\n", d->kind ? "\n" : "", titles[d->kind % 4]);
+            lastFunction = NULL;
+            continue;
+        }
+        if (d->function && d->function != lastFunction)
+            fprintf(f, "Function: %s\n", d->function);
+        lastFunction = d->function;
+        fprintf(f, "%s: %llu\n", d->name, (unsigned long long)sums[r]);
+    }
+    fflush(f);
+    if (m->flags & CS201_PROFILE_MERGE)
+        flock(fd, LOCK_UN);
+    fclose(f);
+    free(sums);
+}
+
+void __cs201_profile_write(void) {
+    for (uint32_t i = 0; i < numModules; ++i)
+        writeModule(&modules[i]);
+}
+
+void __cs201_profile_init(const cs201_desc *table, uint32_t rows, void (*fixup)(void),
+                          const char *pattern, uint64_t moduleHash, uint32_t flags) {
+    modules = realloc(modules, (numModules + 1) * sizeof(cs201_module));
+    modules[numModules].table = table;
+    modules[numModules].rows = rows;
+    modules[numModules].fixup = fixup;
+    modules[numModules].pattern = pattern;
+    modules[numModules].moduleHash = moduleHash;
+    modules[numModules].flags = flags;
+    ++numModules;
+    if (!registered) {
+        registered = 1;
+        pthread_atfork(NULL, NULL, resetInChild);
+        atexit(__cs201_profile_write);
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Runtime support for the CS201Profiling pass.
+ *
+ * The pass only declares these entry points; link the runtime bitcode into
+ * the instrumented module (see buildAndTest.sh) before running it.
+ */
+#ifndef CS201_RUNTIME_H
+#define CS201_RUNTIME_H
+
+#include <stdint.h>
+
+/* -profile-timing: one region per function and per loop header */
+void __cs201_timing_enter(uint32_t id, const char *name);
+void __cs201_timing_exit(uint32_t id);
+void __cs201_timing_dump(void);
+/* -profile-perf: also read perf_event_open counters in every timing region */
+void __cs201_timing_perf(void);
+
+/* -profile-coverage: one bitmap per function, registered from main's dump */
+void __cs201_coverage_add(const char *func, uint8_t *map, uint32_t size);
+void __cs201_coverage_dump(void);
+
+/* -profile-loop-paths: sequences of k iteration paths per loop */
+#define CS201_LOOP_PATH_MAX_K 8
+
+typedef struct {
+    int32_t from;      /* node index, 0 is the loop header */
+    int32_t to;        /* node index, -1: the iteration ends on this edge */
+    uint32_t value;    /* Ball-Larus increment */
+    const char *label; /* to == -1 only: the CFG edge, "b4 -> b1" */
+} cs201_path_edge;
+
+typedef struct {
+    const char *name;
+    const char *const *nodes; /* "[b5]" is an inner loop counted as one node */
+    const cs201_path_edge *edges;
+    uint32_t numEdges;
+    uint32_t numPaths;
+} cs201_loop_desc;
+
+void __cs201_loop_paths_init(const cs201_loop_desc *loops, uint32_t n, uint32_t k,
+                             uint32_t tableSize, uint32_t top);
+void __cs201_loop_path(uint32_t loop, uint32_t path, uint32_t exiting);
+void __cs201_loop_paths_dump(void);
+
+/* -profile-alloc: one site per malloc/calloc/realloc/new call */
+typedef struct {
+    const char *function;
+    const char *block;
+    const char *callee;
+    const char *loop; /* header of the innermost loop around the call, or NULL */
+} cs201_alloc_site;
+
+void __cs201_alloc_init(const cs201_alloc_site *sites, uint32_t n, uint32_t top);
+void __cs201_alloc(uint32_t site, void *ptr, uint64_t size);
+void __cs201_free(void *ptr);
+void __cs201_alloc_dump(void);
+
+/* -profile-file: one row per printed profile line, as emitted by the pass */
+typedef struct {
+    uint32_t kind; /* 0 block, 1 edge, 2 loop, 3 cfg checksum */
+    int32_t slot;  /* coverage bitmap slot, -1 for a uint32 counter */
+    const char *function;
+    const char *name; /* NULL: section title only */
+    void *counter;
+} cs201_desc;
+
+#define CS201_PROFILE_MERGE 1
+#define CS201_PROFILE_BITMAP 2
+
+void __cs201_profile_init(const cs201_desc *table, uint32_t rows, void (*fixup)(void),
+                          const char *pattern, uint64_t moduleHash, uint32_t flags);
+/* for processes that leave through _exit() */
+void __cs201_profile_write(void);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ * Cycle timing for -profile-timing.
+ *
+ * Every thread keeps its own region buckets and a shadow stack of open
+ * regions, so the probes never take a lock. A region's inclusive time is
+ * only charged by its outermost activation (recursion would otherwise count
+ * the same cycles twice); exclusive time is inclusive minus nested regions.
+ * The cost of the probes themselves is measured once at startup and
+ * subtracted from every region.
+ *
+ * With -profile-perf every thread also opens a perf_event_open group
+ * (CS201Perf.c) and each region accumulates the counter deltas of its
+ * outermost activations, like inclusive time. Those include the probes.
+ */
+#define _GNU_SOURCE
+#include "CS201Runtime.h"
+#include "CS201Perf.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+typedef struct {
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    uint32_t active;
+    uint64_t events[CS201_PERF_EVENTS];
+} cs201_region;
+
+typedef struct {
+    uint32_t id;
+    uint64_t start;
+    uint64_t children; /* corrected time of directly nested regions */
+    uint64_t probes;   /* enter/exit pairs executed inside this region */
+    uint64_t events[CS201_PERF_EVENTS];
+} cs201_frame;
+
+/* region names by id; grown under the lock and published atomically, so the
+   probes read them without it. A replaced table is never freed: a probe may
+   still be reading it. */
+typedef struct {
+    uint32_t size;
+    const char *names[];
+} cs201_names;
+
+typedef struct cs201_thread {
+    cs201_region *regions;
+    uint32_t numRegions;
+    cs201_frame *stack;
+    uint32_t depth;
+    uint32_t capacity;
+    cs201_perf_group perf;
+    struct cs201_thread *next;
+} cs201_thread;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+static cs201_thread *threads = NULL;
+static cs201_names *names = NULL;
+static __thread cs201_thread *self = NULL;
+
+static int useTSC = 0;
+static int usePerf = 0;
+static uint64_t selfCost = 0; /* an empty region, enter to exit */
+static uint64_t pairCost = 0; /* one nested enter/exit pair */
+
+static inline uint64_t readTimer(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (useTSC) {
+        unsigned aux;
+        return __rdtscp(&aux);
+    }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void growRegions(cs201_thread *t, uint32_t id) {
+    uint32_t n = t->numRegions ? t->numRegions : 64;
+    while (n <= id)
+        n *= 2;
+    t->regions = realloc(t->regions, n * sizeof(cs201_region));
+    memset(t->regions + t->numRegions, 0, (n - t->numRegions) * sizeof(cs201_region));
+    t->numRegions = n;
+}
+
+static void regionEnter(cs201_thread *t, uint32_t id) {
+    if (id >= t->numRegions)
+        growRegions(t, id);
+    if (t->depth == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 64;
+        t->stack = realloc(t->stack, t->capacity * sizeof(cs201_frame));
+    }
+    cs201_frame *f = &t->stack[t->depth++];
+    f->id = id;
+    f->children = 0;
+    f->probes = 0;
+    t->regions[id].active++;
+    if (t->perf.open)
+        cs201_perf_read(&t->perf, f->events);
+    f->start = readTimer();
+}
+
+static void popFrame(cs201_thread *t, uint64_t now, const uint64_t *events) {
+    cs201_frame *f = &t->stack[--t->depth];
+    cs201_region *r = &t->regions[f->id];
+    uint64_t raw = now - f->start;
+    uint64_t cost = selfCost + f->probes * pairCost;
+    uint64_t elapsed = raw > cost ? raw - cost : 0;
+
+    r->calls++;
+    r->exclusive += elapsed > f->children ? elapsed - f->children : 0;
+    if (--r->active == 0) {
+        r->inclusive += elapsed;
+        for (int i = 0; t->perf.open && i < CS201_PERF_EVENTS; ++i)
+            r->events[i] += events[i] - f->events[i];
+    }
+    if (t->depth) {
+        cs201_frame *parent = &t->stack[t->depth - 1];
+        parent->children += elapsed;
+        parent->probes += f->probes + 1;
+    }
+}
+
+/* Pops every frame above the matching one too: a return from inside a loop
+   leaves that loop without passing through its exit edges. */
+static void regionExit(cs201_thread *t, uint32_t id) {
+    uint64_t now = readTimer();
+    uint64_t events[CS201_PERF_EVENTS];
+    uint32_t d = t->depth;
+    while (d > 0 && t->stack[d - 1].id != id)
+        --d;
+    if (d == 0)
+        return;
+    if (t->perf.open)
+        cs201_perf_read(&t->perf, events);
+    while (t->depth >= d)
+        popFrame(t, now, events);
+}
+
+/* Times the public probes, as the instrumented code calls them, on a scratch
+   thread. Runs once from thread() after initTiming; every other thread waits
+   in pthread_once meanwhile, so ids 0 and 1 can be named and then unnamed. */
+static void calibrate(void) {
+    cs201_thread scratch;
+    cs201_thread *saved = self;
+    uint64_t bestSelf = UINT64_MAX;
+    uint64_t bestPair = UINT64_MAX;
+    const unsigned inner = 1000;
+
+    memset(&scratch, 0, sizeof(scratch));
+    self = &scratch;
+    for (unsigned rep = 0; rep < 10; ++rep) {
+        for (unsigned i = 0; i < inner; ++i) {
+            uint64_t before = scratch.numRegions ? scratch.regions[0].inclusive : 0;
+            __cs201_timing_enter(0, "calibrate");
+            __cs201_timing_exit(0);
+            uint64_t raw = scratch.regions[0].inclusive - before;
+            if (raw < bestSelf)
+                bestSelf = raw;
+        }
+        uint64_t start = readTimer();
+        for (unsigned i = 0; i < inner; ++i) {
+            __cs201_timing_enter(1, "calibrate");
+            __cs201_timing_exit(1);
+        }
+        uint64_t raw = (readTimer() - start) / inner;
+        if (raw < bestPair)
+            bestPair = raw;
+    }
+    self = saved;
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&names->names[0], NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&names->names[1], NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+    /* both were measured with no correction applied yet */
+    selfCost = bestSelf;
+    pairCost = bestPair;
+    free(scratch.regions);
+    free(scratch.stack);
+}
+
+static void initTiming(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    const char *timer = getenv("CS201_TIMER");
+    if (!(timer && strcmp(timer, "clock") == 0) &&
+        __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1u << 27)))
+        useTSC = 1;
+#endif
+}
+
+static cs201_thread *thread(void) {
+    if (!self) {
+        pthread_once(&once, initTiming);
+        /* not inside initTiming: calibrate goes through thread() itself */
+        pthread_once(&calibrated, calibrate);
+        self = calloc(1, sizeof(cs201_thread));
+        if (usePerf && !cs201_perf_open(&self->perf))
+            fprintf(stderr, "cs201: perf_event_open failed, no counters for this thread\n");
+        pthread_mutex_lock(&lock);
+        self->next = threads;
+        threads = self;
+        pthread_mutex_unlock(&lock);
+    }
+    return self;
+}
+
+static int hasName(uint32_t id) {
+    cs201_names *table = __atomic_load_n(&names, __ATOMIC_ACQUIRE);
+    return table && id < table->size && __atomic_load_n(&table->names[id], __ATOMIC_RELAXED);
+}
+
+void __cs201_timing_enter(uint32_t id, const char *name) {
+    cs201_thread *t = thread();
+    if (!hasName(id)) {
+        pthread_mutex_lock(&lock);
+        cs201_names *table = names;
+        if (!table || id >= table->size) {
+            uint32_t n = table ? table->size : 64;
+            while (n <= id)
+                n *= 2;
+            cs201_names *grown = calloc(1, sizeof(cs201_names) + n * sizeof(const char *));
+            grown->size = n;
+            if (table)
+                memcpy(grown->names, table->names, table->size * sizeof(const char *));
+            __atomic_store_n(&names, grown, __ATOMIC_RELEASE);
+            table = grown;
+        }
+        __atomic_store_n(&table->names[id], name, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+    }
+    regionEnter(t, id);
+}
+
+void __cs201_timing_exit(uint32_t id) {
+    regionExit(thread(), id);
+}
+
+void __cs201_timing_perf(void) {
+    usePerf = 1;
+}
+
+/* regions ranked by one counter */
+static void printHotSpots(cs201_region *sums, int event) {
+    const char *const *events = cs201_perf_names();
+    uint32_t order[10];
+    uint32_t n = 0;
+    for (uint32_t id = 0; names && id < names->size; ++id) {
+        if (!names->names[id] || !sums[id].events[event])
+            continue;
+        uint32_t pos = n < 10 ? n++ : 10;
+        while (pos > 0 && sums[order[pos - 1]].events[event] < sums[id].events[event]) {
+            if (pos < 10)
+                order[pos] = order[pos - 1];
+            --pos;
+        }
+        if (pos < 10)
+            order[pos] = id;
+    }
+    if (!n)
+        return;
+    printf("\nHOT SPOTS (%s):\n", events[event]);
+    for (uint32_t i = 0; i < n; ++i)
+        printf("%s: %llu\n", names->names[order[i]], (unsigned long long)sums[order[i]].events[event]);
+}
+
+void __cs201_timing_dump(void) {
+    pthread_mutex_lock(&lock);
+    printf("\nTIMING PROFILING (%s, probe pair overhead %llu):\n",
+           useTSC ? "cycles" : "ns", (unsigned long long)pairCost);
+    uint32_t numNames = names ? names->size : 0;
+    cs201_region *sums = calloc(numNames ? numNames : 1, sizeof(cs201_region));
+    for (uint32_t id = 0; id < numNames; ++id) {
+        if (!names->names[id])
+            continue;
+        cs201_region *sum = &sums[id];
+        for (cs201_thread *t = threads; t; t = t->next) {
+            if (id >= t->numRegions)
+                continue;
+            sum->calls += t->regions[id].calls;
+            sum->inclusive += t->regions[id].inclusive;
+            sum->exclusive += t->regions[id].exclusive;
+            for (int i = 0; i < CS201_PERF_EVENTS; ++i)
+                sum->events[i] += t->regions[id].events[i];
+        }
+        printf("%s: calls %llu inclusive %llu exclusive %llu", names->names[id],
+               (unsigned long long)sum->calls, (unsigned long long)sum->inclusive,
+               (unsigned long long)sum->exclusive);
+        for (int i = 0; usePerf && i < CS201_PERF_EVENTS; ++i)
+            printf(" %s %llu", cs201_perf_names()[i], (unsigned long long)sum->events[i]);
+        printf("\n");
+    }
+    if (usePerf) {
+        printf("\nPERF COUNTERS (%s events, inclusive):\n", cs201_perf_kind());
+        for (int i = 1; i < CS201_PERF_EVENTS; ++i)
+            printHotSpots(sums, i);
+    }
+    free(sums);
+    pthread_mutex_unlock(&lock);
+}
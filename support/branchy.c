@@ -0,0 +1,63 @@
+// Branchy kernels for -cs201-superblock (benchSuperblock.sh): a switch
+// interpreter whose hot loop runs through a few opcodes, and a classifier
+// whose biased branches meet again after every test.
+//   support/branchy [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { LOADI, ADD, MULI, XOR, SUBI, JNZ, HALT };
+
+// four ints per instruction: op, destination, operand, operand/immediate
+static unsigned interp(const int *code, unsigned n) {
+    unsigned r[4] = {0, n, 0, 0};
+    int pc = 0;
+    for (;;) {
+        const int *ins = code + 4 * pc++;
+        switch (ins[0]) {
+        case LOADI: r[ins[1]] = ins[3]; break;
+        case ADD:   r[ins[1]] = r[ins[2]] + r[ins[3]]; break;
+        case MULI:  r[ins[1]] = r[ins[2]] * ins[3]; break;
+        case XOR:   r[ins[1]] = r[ins[2]] ^ r[ins[3]]; break;
+        case SUBI:  r[ins[1]] = r[ins[2]] - ins[3]; break;
+        case JNZ:   if (r[ins[1]]) pc = ins[3]; break;
+        case HALT:  return r[ins[1]];
+        default:    abort();
+        }
+    }
+}
+
+static unsigned classify(unsigned x) {
+    unsigned r = 0;
+    if (x % 16 != 0)
+        r += x >> 1;
+    else
+        r ^= x;
+    if (x % 97 == 0)
+        r *= 3;
+    else
+        r += 1;
+    if ((x & 0xff) < 250)
+        r = r * 33 + 7;
+    else
+        r -= x;
+    return r;
+}
+
+int main(int argc, char **argv) {
+    static const int program[] = {
+        LOADI, 0, 0, 0,     // r0 = 0
+        LOADI, 2, 0, 1,     // r2 = 1
+        ADD,   0, 0, 1,     // loop: r0 += r1
+        MULI,  0, 0, 3,     // r0 *= 3
+        XOR,   0, 0, 1,     // r0 ^= r1
+        SUBI,  1, 1, 1,     // r1 -= 1
+        JNZ,   1, 0, 2,     // if r1 goto loop
+        HALT,  0, 0, 0,
+    };
+    unsigned n = argc > 1 ? (unsigned)atoi(argv[1]) : 1000;
+    unsigned acc = interp(program, n);
+    for (unsigned i = 0; i < n; ++i)
+        acc += classify(i * 2654435761u);
+    printf("branchy %u: %u\n", n, acc);
+    return 0;
+}
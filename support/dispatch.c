@@ -0,0 +1,42 @@
+// Edge shapes that only survive optimization: build with
+//   CLANG_FLAGS=-O2 ./buildAndTest.sh dispatch
+// run() is a computed-goto interpreter (indirectbr), classify() a switch
+// with several cases on one target, and the loop-carried values become PHIs.
+int run(const unsigned char *code, int acc) {
+    static void *ops[] = {&&INC, &&DBL, &&DEC, &&HALT};
+    const unsigned char *pc = code;
+    goto *ops[*pc++];
+INC:
+    acc += 1;
+    goto *ops[*pc++];
+DBL:
+    acc *= 2;
+    goto *ops[*pc++];
+DEC:
+    acc -= 3;
+    goto *ops[*pc++];
+HALT:
+    return acc;
+}
+
+int classify(int x) {
+    switch (x % 8) {
+    case 0: case 3: case 5:
+        return x / 2;
+    case 1: case 6:
+        return x * 3;
+    default:
+        return x;
+    }
+}
+
+int main() {
+    unsigned char code[64];
+    int i, acc = 0;
+    for (i = 0; i < 63; ++i)
+        code[i] = (i * 7) % 3;
+    code[63] = 3;
+    for (i = 0; i < 100; ++i)
+        acc = run(code, classify(acc + i) & 0xffff);
+    return acc == 12345;
+}
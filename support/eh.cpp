@@ -0,0 +1,25 @@
+// Invokes and landing pads: build with CLANG_FLAGS=-O2 ./buildAndTest.sh eh
+// Both calls in main unwind to the same catch, so its landing pad has two
+// invoke predecessors.
+static int depth = 0;
+
+__attribute__((noinline)) int check(int x) {
+    if (x % 7 == 0)
+        throw x;
+    return x + 1;
+}
+
+int main() {
+    int caught = 0, sum = 0;
+    for (int i = 0; i < 100; ++i) {
+        try {
+            sum += check(i);
+            sum += check(i + 3);
+        }
+        catch (int e) {
+            ++caught;
+            depth = e;
+        }
+    }
+    return (sum + caught + depth) & 0x7f;
+}
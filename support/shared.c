@@ -0,0 +1,27 @@
+// Control-equivalent blocks for -profile-share-counters: the entry and join
+// of each if/else, and the straight-line blocks split by the calls, all run
+// as often as the block that dominates them. testCs201Run.sh checks that
+// cs201-run prints the same count for each of them as the printf dump.
+#include <stdio.h>
+
+static int step(int x) {
+    int y = x * 3;
+    if (y & 1)
+        y += 7;
+    else
+        y /= 2;
+    y ^= x;
+    if (y % 5 == 0)
+        y -= 1;
+    return y;
+}
+
+int main() {
+    int acc = 0;
+    for (int i = 0; i < 100; ++i) {
+        acc += step(i);
+        acc = acc > 1000 ? acc - 1000 : acc;
+        printf("%d\n", acc);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+# cs201-run against the opt/lli dump: the BASIC BLOCK, EDGE and LOOP PROFILING
+# sections of both must agree line for line. support/shared.c has blocks that
+# share a counter (-profile-share-counters), which cs201-run reads by symbol;
+# 3.c nests two loops and 4.c has the same loop in two functions.
+INPUTS=${INPUTS:-"shared test 3 4"}
+STDIN=${STDIN:-5}
+# pass options for both runs; sharing is opt-in, so turn it on here
+PROFILE_FLAGS=${PROFILE_FLAGS:-"-profile-share-counters"}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+PLUGIN=../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}
+
+# "function name: count" for every line of the counter sections, sorted; loop
+# lines have no "Function:" header and are keyed by their blocks alone
+counts() {
+    awk '/^BASIC BLOCK PROFILING:|^EDGE PROFILING:|^LOOP PROFILING:/ { on = 1; f = ""; next }
+         /PROFILING:|CHECKSUMS:/ { on = 0 }
+         on && /^Function: / { f = $2; next }
+         on && /: / { print f, $0 }' | sort
+}
+
+FAILED=0
+for INPUT in ${INPUTS}; do
+    echo ${STDIN} | PROFILE_FLAGS="${PROFILE_FLAGS}" ./buildAndTest.sh ${INPUT} | counts > support/${INPUT}.dump.counts || exit 1
+    echo ${STDIN} | ${BIN}/cs201-run -load ${PLUGIN} ${PROFILE_FLAGS} -profile-dump=false -O0 support/${INPUT}.bc | counts > support/${INPUT}.run.counts
+    if cmp -s support/${INPUT}.dump.counts support/${INPUT}.run.counts; then
+        echo "${INPUT}: ok"
+    else
+        echo "${INPUT}: FAILED"
+        diff support/${INPUT}.dump.counts support/${INPUT}.run.counts | head -20
+        FAILED=1
+    fi
+done
+exit ${FAILED}
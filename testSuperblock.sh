@@ -0,0 +1,29 @@
+# Correctness of -cs201-superblock: profile each support/ program, form
+# superblocks from that profile, and check that the transformed bitcode
+# passes -verify and prints exactly what the original does.
+INPUTS=${INPUTS:-"1 2 3 4 ex1 printf test dispatch eh branchy"}
+# stdin for the programs that read a number
+STDIN=${STDIN:-5}
+LLVM_HOME=~/Workspace
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+else
+    SHARED_LIB_EXT=so;
+fi
+BIN=${LLVM_HOME}/llvm/Release+Asserts/bin
+PLUGIN=../../../Release+Asserts/lib/CS201Profiling.${SHARED_LIB_EXT}
+
+FAILED=0
+for INPUT in ${INPUTS}; do
+    echo ${STDIN} | ./buildAndTest.sh ${INPUT} > support/${INPUT}.profile && \
+        ${BIN}/opt -load ${PLUGIN} -cs201-superblock -cs201-profile-use=support/${INPUT}.profile -verify support/${INPUT}.bc -o support/${INPUT}.sb.bc || exit 1
+    echo ${STDIN} | ${BIN}/lli support/${INPUT}.bc > support/${INPUT}.base.out; BASE=$?
+    echo ${STDIN} | ${BIN}/lli support/${INPUT}.sb.bc > support/${INPUT}.sb.out; SB=$?
+    if [ ${BASE} != ${SB} ] || ! cmp -s support/${INPUT}.base.out support/${INPUT}.sb.out; then
+        echo "${INPUT}: FAILED (exit ${BASE} vs ${SB})"
+        FAILED=1
+    else
+        echo "${INPUT}: ok"
+    fi
+done
+exit ${FAILED}
@@ -0,0 +1,258 @@
+//===- cs201-gen.cpp - Synthetic CFGs for scaling the profiling pass ------===//
+//
+//   cs201-gen -shape=mesh -size=10000 -o mesh.bc
+//
+// Writes a module whose main calls one generated function (or -size
+// functions for -shape=functions). The code looks like clang -O0 output:
+// every variable lives in an alloca, so there are no PHI nodes and the
+// -pathProfiling pass can instrument it like the support/ programs.
+//
+//   chain      -size blocks in a straight line
+//   switch     one switch with -size cases
+//   loops      -size nested loops, each running -trip times (trip^size
+//              iterations, so only run small nests)
+//   mesh       an irreducible goto mesh of -size nodes, support/1.c's
+//              function_1 grown large: two entries into the cycle and
+//              every node jumping to two pseudo-random others
+//   functions  -size small functions (a diamond and a loop each)
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+enum Shape { Chain, Switch, Loops, Mesh, Functions };
+static cl::opt<Shape> GenShape("shape", cl::desc("CFG shape"), cl::init(Chain),
+    cl::values(clEnumValN(Chain, "chain", "straight-line blocks"),
+               clEnumValN(Switch, "switch", "one huge switch"),
+               clEnumValN(Loops, "loops", "deep loop nest"),
+               clEnumValN(Mesh, "mesh", "irreducible goto mesh"),
+               clEnumValN(Functions, "functions", "many small functions"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> Size("size", cl::desc("Blocks, cases, loop depth, mesh nodes or functions"), cl::init(100));
+
+static cl::opt<unsigned> Trip("trip", cl::desc("Iterations of each loop in -shape=loops"), cl::init(2));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output bitcode"), cl::value_desc("filename"), cl::init("-"));
+
+namespace {
+    struct Generator {
+        Module &M;
+        LLVMContext &C;
+        Type *i32;
+        Function *F;
+        Value *x;
+        BasicBlock *exit;
+
+        Generator(Module &M) : M(M), C(M.getContext()), i32(Type::getInt32Ty(M.getContext())) {}
+
+        // i32 name(i32) with the argument stored in %x; the caller fills in the
+        // body between the entry block and the returned exit block
+        BasicBlock *begin(StringRef name) {
+            F = Function::Create(FunctionType::get(i32, {i32}, false), GlobalValue::ExternalLinkage, name, &M);
+            BasicBlock *entry = BasicBlock::Create(C, "entry", F);
+            IRBuilder<> IRB(entry);
+            x = IRB.CreateAlloca(i32, nullptr, "x");
+            IRB.CreateStore(&*F->arg_begin(), x);
+            exit = BasicBlock::Create(C, "exit", F);
+            IRBuilder<> ret(exit);
+            ret.CreateRet(ret.CreateLoad(x));
+            return entry;
+        }
+
+        void bump(IRBuilder<> &IRB, unsigned k) {
+            Value *v = IRB.CreateLoad(x);
+            IRB.CreateStore(IRB.CreateAnd(IRB.CreateAdd(IRB.CreateMul(v, IRB.getInt32(3)), IRB.getInt32(k)), IRB.getInt32(0xffff)), x);
+        }
+
+        Function *chain(unsigned n) {
+            BasicBlock *entry = begin("chain");
+            BasicBlock *prev = entry;
+            for (unsigned i = 0; i < n; ++i) {
+                BasicBlock *BB = BasicBlock::Create(C, "c", F, exit);
+                IRBuilder<>(prev).CreateBr(BB);
+                IRBuilder<> IRB(BB);
+                bump(IRB, i);
+                prev = BB;
+            }
+            IRBuilder<>(prev).CreateBr(exit);
+            return F;
+        }
+
+        Function *switchFanOut(unsigned n) {
+            BasicBlock *entry = begin("fanout");
+            IRBuilder<> IRB(entry);
+            Value *v = IRB.CreateURem(IRB.CreateLoad(x), IRB.getInt32(n ? n : 1));
+            SwitchInst *sw = IRB.CreateSwitch(v, exit, n);
+            for (unsigned i = 0; i < n; ++i) {
+                BasicBlock *BB = BasicBlock::Create(C, "case", F, exit);
+                IRBuilder<> caseIRB(BB);
+                bump(caseIRB, i);
+                caseIRB.CreateBr(exit);
+                sw->addCase(IRB.getInt32(i), BB);
+            }
+            return F;
+        }
+
+        Function *loopNest(unsigned depth, unsigned trip) {
+            BasicBlock *entry = begin("nest");
+            IRBuilder<> IRB(entry);
+            std::vector<Value*> iv;
+            for (unsigned k = 0; k < depth; ++k) {
+                iv.push_back(IRB.CreateAlloca(i32, nullptr, "i"));
+            }
+            std::vector<BasicBlock*> header, latch;
+            for (unsigned k = 0; k < depth; ++k) {
+                header.push_back(BasicBlock::Create(C, "header", F, exit));
+                latch.push_back(BasicBlock::Create(C, "latch", F, exit));
+            }
+            BasicBlock *body = BasicBlock::Create(C, "body", F, exit);
+            // entering level k resets its induction variable
+            BasicBlock *prev = entry;
+            for (unsigned k = 0; k < depth; ++k) {
+                IRBuilder<> pre(prev);
+                pre.CreateStore(pre.getInt32(0), iv[k]);
+                pre.CreateBr(header[k]);
+                IRBuilder<> head(header[k]);
+                Value *more = head.CreateICmpULT(head.CreateLoad(iv[k]), head.getInt32(trip));
+                BasicBlock *inside = BasicBlock::Create(C, "inside", F, exit);
+                head.CreateCondBr(more, inside, k ? latch[k-1] : exit);
+                IRBuilder<> next(latch[k]);
+                next.CreateStore(next.CreateAdd(next.CreateLoad(iv[k]), next.getInt32(1)), iv[k]);
+                next.CreateBr(header[k]);
+                prev = inside;
+            }
+            IRBuilder<>(prev).CreateBr(body);
+            IRBuilder<> bodyIRB(body);
+            bump(bodyIRB, 1);
+            bodyIRB.CreateBr(depth ? latch[depth-1] : exit);
+            return F;
+        }
+
+        Function *mesh(unsigned n) {
+            BasicBlock *entry = begin("mesh");
+            if (n == 0) {
+                IRBuilder<>(entry).CreateBr(exit);
+                return F;
+            }
+            std::vector<BasicBlock*> node, test;
+            for (unsigned i = 0; i < n; ++i) {
+                node.push_back(BasicBlock::Create(C, "node", F, exit));
+                test.push_back(BasicBlock::Create(C, "test", F, exit));
+            }
+            IRBuilder<> IRB(entry);
+            // bound the walk like function_1's countdown
+            IRB.CreateStore(IRB.CreateAdd(IRB.CreateAnd(IRB.CreateLoad(x), IRB.getInt32(0xff)), IRB.getInt32(n)), x);
+            Value *odd = IRB.CreateTrunc(IRB.CreateLoad(x), Type::getInt1Ty(C));
+            IRB.CreateCondBr(odd, node[0], node[n / 2]);
+            for (unsigned i = 0; i < n; ++i) {
+                IRBuilder<> step(node[i]);
+                Value *v = step.CreateSub(step.CreateLoad(x), step.getInt32(1));
+                step.CreateStore(v, x);
+                step.CreateCondBr(step.CreateICmpEQ(v, step.getInt32(0)), exit, test[i]);
+                IRBuilder<> pick(test[i]);
+                Value *low = pick.CreateICmpEQ(pick.CreateAnd(v, pick.getInt32(3)), pick.getInt32(0));
+                pick.CreateCondBr(low, node[(7 * (uint64_t)i + 1) % n], node[(13 * (uint64_t)i + 5) % n]);
+            }
+            return F;
+        }
+
+        Function *small(unsigned k) {
+            BasicBlock *entry = begin("f" + std::to_string(k));
+            BasicBlock *then = BasicBlock::Create(C, "then", F, exit);
+            BasicBlock *other = BasicBlock::Create(C, "else", F, exit);
+            BasicBlock *header = BasicBlock::Create(C, "header", F, exit);
+            BasicBlock *body = BasicBlock::Create(C, "body", F, exit);
+            IRBuilder<> IRB(entry);
+            Value *i = IRB.CreateAlloca(i32, nullptr, "i");
+            IRB.CreateStore(IRB.getInt32(0), i);
+            IRB.CreateCondBr(IRB.CreateTrunc(IRB.CreateLoad(x), Type::getInt1Ty(C)), then, other);
+            IRBuilder<> t(then);
+            bump(t, k);
+            t.CreateBr(header);
+            IRBuilder<> e(other);
+            bump(e, k + 1);
+            e.CreateBr(header);
+            IRBuilder<> h(header);
+            h.CreateCondBr(h.CreateICmpULT(h.CreateLoad(i), h.getInt32(2)), body, exit);
+            IRBuilder<> b(body);
+            b.CreateStore(b.CreateAdd(b.CreateLoad(i), b.getInt32(1)), i);
+            bump(b, 2);
+            b.CreateBr(header);
+            return F;
+        }
+
+        // int main(int argc, char **argv) { calls...; return 0; }
+        void makeMain(const std::vector<Function*> &callees) {
+            Type *argvTy = Type::getInt8PtrTy(C)->getPointerTo();
+            Function *main = Function::Create(FunctionType::get(i32, {i32, argvTy}, false), GlobalValue::ExternalLinkage, "main", &M);
+            IRBuilder<> IRB(BasicBlock::Create(C, "entry", main));
+            Value *arg = &*main->arg_begin();
+            for (Function *callee: callees) {
+                arg = IRB.CreateCall(callee, arg);
+            }
+            IRB.CreateRet(IRB.getInt32(0));
+        }
+    };
+}
+
+int main(int argc, char **argv) {
+    sys::PrintStackTraceOnErrorSignal();
+    PrettyStackTraceProgram X(argc, argv);
+    llvm_shutdown_obj Y;
+    cl::ParseCommandLineOptions(argc, argv, "CS201 synthetic CFG generator\n");
+
+    LLVMContext &Context = getGlobalContext();
+    Module M("cs201-gen", Context);
+    Generator G(M);
+    std::vector<Function*> callees;
+    switch (GenShape) {
+    case Chain:
+        callees.push_back(G.chain(Size));
+        break;
+    case Switch:
+        callees.push_back(G.switchFanOut(Size));
+        break;
+    case Loops:
+        callees.push_back(G.loopNest(Size, Trip));
+        break;
+    case Mesh:
+        callees.push_back(G.mesh(Size));
+        break;
+    case Functions:
+        for (unsigned k = 0; k < Size; ++k) {
+            callees.push_back(G.small(k));
+        }
+        break;
+    }
+    G.makeMain(callees);
+    if (verifyModule(M, &errs())) {
+        errs() << argv[0] << ": generated module is broken\n";
+        return 1;
+    }
+
+    std::error_code EC;
+    tool_output_file Out(OutputFilename, EC, sys::fs::F_None);
+    if (EC) {
+        errs() << argv[0] << ": " << OutputFilename << ": " << EC.message() << '\n';
+        return 1;
+    }
+    WriteBitcodeToFile(&M, Out.os());
+    Out.keep();
+    return 0;
+}
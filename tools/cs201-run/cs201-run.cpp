@@ -0,0 +1,254 @@
+//===- cs201-run.cpp - Instrument and run bitcode in one process ----------===//
+//
+//   cs201-run -load CS201Profiling.so -profile-dump=false [-O2]
+//             [-runtime runtime/CS201Timing.bc ...] prog.bc [program args...]
+//
+// Does in memory what buildAndTest.sh does with opt, llvm-as and lli: runs
+// -pathProfiling on prog.bc, optimizes the result, JIT-compiles it with ORC,
+// runs llvm.global_ctors, main and llvm.global_dtors as lli does, and then
+// reads the block, edge and loop counters listed in !cs201.counters straight
+// from JIT memory. The report uses the same
+// "Function: name" layout as the printf dump, so ProfileData reads it too.
+// -profile-coverage modules keep bitmaps instead and are refused.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/PassSupport.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::desc("<input bitcode>"), cl::Required);
+
+static cl::list<std::string> InputArgv(cl::ConsumeAfter, cl::desc("<program arguments>..."));
+
+static cl::opt<char> OptLevel("O",
+    cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+    cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+
+static cl::list<std::string> RuntimeFiles("runtime",
+    cl::desc("Runtime bitcode linked in after instrumentation"),
+    cl::value_desc("bitcode"));
+
+static cl::opt<std::string> InstrumentPass("instrument", cl::init("pathProfiling"),
+    cl::desc("Instrumentation pass to run before the JIT"));
+
+namespace {
+    struct Counter {
+        std::string kind;
+        std::string function;
+        std::string name;
+        std::string symbol;
+    };
+}
+
+static std::string mangle(const TargetMachine &TM, StringRef name) {
+    std::string mangled;
+    raw_string_ostream os(mangled);
+    Mangler::getNameWithPrefix(os, name, *TM.getDataLayout());
+    return os.str();
+}
+
+// Counters are internal globals; give each a unique external name so it can
+// be looked up after JIT linking, before the optimizer gets to them. Blocks
+// sharing a counter (-profile-share-counters) list the same global, which
+// is named once and read under that one name for all of them.
+static std::vector<Counter> exposeCounters(Module &M) {
+    std::vector<Counter> counters;
+    std::map<GlobalVariable*, std::string> symbols;
+    NamedMDNode *desc = M.getNamedMetadata("cs201.counters");
+    if (!desc) {
+        return counters;
+    }
+    for (unsigned i = 0; i < desc->getNumOperands(); ++i) {
+        MDNode *N = desc->getOperand(i);
+        GlobalVariable *GV = mdconst::extract<GlobalVariable>(N->getOperand(3));
+        Counter c;
+        c.kind = cast<MDString>(N->getOperand(0))->getString();
+        c.function = cast<MDString>(N->getOperand(1))->getString();
+        c.name = cast<MDString>(N->getOperand(2))->getString();
+        auto symbol = symbols.find(GV);
+        if (symbol == symbols.end()) {
+            std::string name = ("__cs201_counter." + Twine(symbols.size())).str();
+            GV->setName(name);
+            GV->setLinkage(GlobalValue::ExternalLinkage);
+            symbol = symbols.insert(std::make_pair(GV, name)).first;
+        }
+        c.symbol = symbol->second;
+        counters.push_back(c);
+    }
+    return counters;
+}
+
+int main(int argc, char **argv) {
+    sys::PrintStackTraceOnErrorSignal();
+    PrettyStackTraceProgram X(argc, argv);
+    llvm_shutdown_obj Y;
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    cl::ParseCommandLineOptions(argc, argv, "CS201 instrument-and-run driver\n");
+
+    LLVMContext &Context = getGlobalContext();
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIRFile(InputFile, Err, Context);
+    if (!M) {
+        Err.print(argv[0], errs());
+        return 1;
+    }
+
+    const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(InstrumentPass);
+    if (!PI) {
+        errs() << argv[0] << ": pass '" << InstrumentPass << "' is not registered (forgot -load CS201Profiling.so?)\n";
+        return 1;
+    }
+    legacy::PassManager Instrument;
+    Instrument.add(PI->createPass());
+    Instrument.run(*M);
+    if (NamedMDNode *coverage = M->getNamedMetadata("cs201.coverage")) {
+        StringRef mode = cast<MDString>(coverage->getOperand(0)->getOperand(0))->getString();
+        errs() << argv[0] << ": " << InputFile << " was instrumented with -profile-coverage=" << mode
+               << ", which keeps bitmaps rather than counters; run it with buildAndTest.sh instead\n";
+        return 1;
+    }
+
+    // after instrumenting, or the runtime would be instrumented too
+    for (auto &file: RuntimeFiles) {
+        std::unique_ptr<Module> R = parseIRFile(file, Err, Context);
+        if (!R) {
+            Err.print(argv[0], errs());
+            return 1;
+        }
+        if (Linker::LinkModules(M.get(), R.get())) {
+            errs() << argv[0] << ": cannot link " << file << '\n';
+            return 1;
+        }
+    }
+    std::vector<Counter> counters = exposeCounters(*M);
+
+    unsigned level = OptLevel - '0';
+    legacy::PassManager Optimize;
+    PassManagerBuilder PMB;
+    PMB.OptLevel = level;
+    if (level > 1) {
+        PMB.Inliner = createFunctionInliningPass(level, 0);
+    }
+    Optimize.add(createVerifierPass());
+    PMB.populateModulePassManager(Optimize);
+    Optimize.run(*M);
+
+    CodeGenOpt::Level codeGenLevel = level == 0 ? CodeGenOpt::None : level == 1 ? CodeGenOpt::Less : level == 2 ? CodeGenOpt::Default : CodeGenOpt::Aggressive;
+    std::unique_ptr<TargetMachine> TM(EngineBuilder().setOptLevel(codeGenLevel).selectTarget());
+    M->setDataLayout(*TM->getDataLayout());
+
+    // llvm.global_ctors holds the runtime's init (-profile-file, loop paths,
+    // perf, alloc) and the program's own static constructors
+    std::vector<std::string> ctorNames, dtorNames;
+    for (auto ctor: orc::getConstructors(*M)) {
+        ctorNames.push_back(mangle(*TM, ctor.Func->getName()));
+    }
+    for (auto dtor: orc::getDestructors(*M)) {
+        dtorNames.push_back(mangle(*TM, dtor.Func->getName()));
+    }
+
+    // the JIT'd code calls into libc through the host process
+    sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    orc::ObjectLinkingLayer<> ObjectLayer;
+    orc::IRCompileLayer<decltype(ObjectLayer)> CompileLayer(ObjectLayer, orc::SimpleCompiler(*TM));
+    auto Resolver = orc::createLambdaResolver(
+        [&](const std::string &Name) {
+            if (auto Sym = CompileLayer.findSymbol(Name, false)) {
+                return RuntimeDyld::SymbolInfo(Sym.getAddress(), Sym.getFlags());
+            }
+            return RuntimeDyld::SymbolInfo(nullptr);
+        },
+        [](const std::string &Name) {
+            if (uint64_t Addr = RTDyldMemoryManager::getSymbolAddressInProcess(Name)) {
+                return RuntimeDyld::SymbolInfo(Addr, JITSymbolFlags::Exported);
+            }
+            return RuntimeDyld::SymbolInfo(nullptr);
+        });
+    std::vector<std::unique_ptr<Module>> Modules;
+    Modules.push_back(std::move(M));
+    auto H = CompileLayer.addModuleSet(std::move(Modules), make_unique<SectionMemoryManager>(), std::move(Resolver));
+
+    orc::CtorDtorRunner<decltype(CompileLayer)> ctors(std::move(ctorNames), H);
+    orc::CtorDtorRunner<decltype(CompileLayer)> dtors(std::move(dtorNames), H);
+
+    auto MainSym = CompileLayer.findSymbolIn(H, mangle(*TM, "main"), false);
+    if (!MainSym) {
+        errs() << argv[0] << ": no main in " << InputFile << '\n';
+        return 1;
+    }
+    std::vector<std::string> argStrings(1, InputFile);
+    argStrings.insert(argStrings.end(), InputArgv.begin(), InputArgv.end());
+    std::vector<char*> args;
+    for (auto &arg: argStrings) {
+        args.push_back(&arg[0]);
+    }
+    args.push_back(nullptr);
+    typedef int (*MainFn)(int, char**);
+    MainFn mainFn = (MainFn)(intptr_t)MainSym.getAddress();
+    if (!ctors.runViaLayer(CompileLayer)) {
+        errs() << argv[0] << ": cannot run the static constructors of " << InputFile << '\n';
+        return 1;
+    }
+    int rc = mainFn(argStrings.size(), args.data());
+    dtors.runViaLayer(CompileLayer);
+    fflush(stdout);
+
+    const char *kinds[] = {"block", "edge", "loop", "cfg"};
+    const char *titles[] = {"BASIC BLOCK PROFILING:\n", "\nEDGE PROFILING:\n", "\nLOOP PROFILING:\n", "\nCFG CHECKSUMS:\n"};
+    for (unsigned k = 0; k < 4; ++k) {
+        outs() << titles[k];
+        std::string function;
+        for (auto &c: counters) {
+            if (c.kind != kinds[k]) {
+                continue;
+            }
+            // loop rows carry no "Function:" header in the printf dump either
+            if (c.kind != "loop" && c.function != function) {
+                function = c.function;
+                outs() << "Function: " << function << '\n';
+            }
+            auto Sym = CompileLayer.findSymbolIn(H, mangle(*TM, c.symbol), false);
+            int32_t count = Sym ? *(int32_t*)(intptr_t)Sym.getAddress() : 0;
+            outs() << c.name << ": " << count << '\n';
+        }
+    }
+    outs().flush();
+    return rc;
+}